@@ -30,6 +30,33 @@
 #include <QTemporaryFile>
 #include <QSpinBox>
 #include <QDateTime>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QSaveFile>
+#include <QCommandLineParser>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QVersionNumber>
+#include <QSysInfo>
+#include <QFileInfo>
+#include <QRegularExpression>
+#include <QRandomGenerator>
+#include <QUuid>
+#include <array>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/if_alg.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#endif
+
+#ifndef SOL_ALG
+#define SOL_ALG 279
+#endif
 
 class PasswordDialog : public QDialog {
 public:
@@ -128,6 +155,1655 @@ private:
     QString m_sudoPassword;
 };
 
+static QMap<QString, QString> defaultSettings() {
+    QMap<QString, QString> settings;
+    settings["targetDisk"] = "";
+    settings["hostname"] = "";
+    settings["timezone"] = "";
+    settings["keymap"] = "";
+    settings["username"] = "";
+    settings["desktopEnv"] = "";
+    settings["bootloader"] = "";
+    settings["initSystem"] = "";
+    settings["compressionLevel"] = "";
+    settings["installCompression"] = "target";
+    settings["dataProfile"] = "single";
+    settings["metadataProfile"] = "dup";
+    settings["encryption"] = "none";
+    settings["installMode"] = "fresh";
+    settings["rootPassword"] = "";
+    settings["userPassword"] = "";
+    return settings;
+}
+
+static QStringList missingSettings(const QMap<QString, QString> &settings, const QStringList &keys) {
+    static const QList<QPair<QString, QString>> labels = {
+        {"targetDisk", "Target Disk"},
+        {"hostname", "Hostname"},
+        {"timezone", "Timezone"},
+        {"keymap", "Keymap"},
+        {"username", "Username"},
+        {"desktopEnv", "Desktop Environment"},
+        {"bootloader", "Bootloader"},
+        {"initSystem", "Init System"},
+        {"compressionLevel", "Compression Level"},
+        {"installCompression", "Install Compression"},
+        {"dataProfile", "Data Profile"},
+        {"metadataProfile", "Metadata Profile"},
+        {"installMode", "Install Mode"},
+        {"rootPassword", "Root Password"},
+        {"userPassword", "User Password"},
+        {"encryptionPassword", "Encryption Passphrase"}
+    };
+
+    QStringList missing;
+    for (const auto &label : labels) {
+        if (keys.contains(label.first) && settings.value(label.first).isEmpty()) {
+            missing << label.second;
+        }
+    }
+    return missing;
+}
+
+// targetDisk holds one or more disks separated by spaces or commas.
+static QStringList targetDisks(const QString &targetDisk) {
+    return targetDisk.split(QRegularExpression("[\\s,]+"), Qt::SkipEmptyParts);
+}
+
+// Separate installations are separated by ';', so "/dev/sda;/dev/sdb" installs
+// two independent systems in parallel.
+static QStringList targetGroups(const QString &targetDisk) {
+    QStringList groups;
+    for (const QString &group : targetDisk.split(';')) {
+        if (!group.trimmed().isEmpty()) groups << group.trimmed();
+    }
+    return groups;
+}
+
+// Settings for each installation target with its own disks, hostname, mount
+// root and session number. A single target keeps /mnt as its mount root.
+static QList<QMap<QString, QString>> targetSettings(const QMap<QString, QString> &settings) {
+    QStringList groups = targetGroups(settings.value("targetDisk"));
+    QStringList hostnames = settings.value("hostname").split(';');
+    QList<QMap<QString, QString>> targets;
+    for (int i = 0; i < groups.size(); ++i) {
+        QMap<QString, QString> target = settings;
+        target["targetDisk"] = groups[i];
+        if (hostnames.size() == groups.size()) {
+            target["hostname"] = hostnames[i].trimmed();
+        } else if (groups.size() > 1 && !hostnames[0].trimmed().isEmpty()) {
+            target["hostname"] = QString("%1-%2").arg(hostnames[0].trimmed()).arg(i + 1);
+        }
+        target["session"] = QString::number(i + 1);
+        target["root"] = groups.size() > 1 ? QString("/mnt/target-%1").arg(i + 1) : QString("/mnt");
+        targets << target;
+    }
+    return targets;
+}
+
+static QString partitionPath(const QString &disk, int number) {
+    // nvme0n1 -> nvme0n1p1, sda -> sda1
+    bool endsWithDigit = !disk.isEmpty() && disk.back().isDigit();
+    return disk + (endsWithDigit ? "p" : "") + QString::number(number);
+}
+
+// Every disk gets its own ESP; the first is /boot/efi, the others get their
+// own bootloader copy at install time as fallbacks and are not updated later.
+// With an encrypted root the kernel and initramfs have to stay readable by the
+// bootloader, so the ESP becomes /boot.
+static QString espMountPoint(int disk, bool encrypted = false) {
+    if (disk == 1) {
+        return encrypted ? QString("/boot") : QString("/boot/efi");
+    }
+    return QString("/boot/efi%1").arg(disk);
+}
+
+// Number of failed devices a btrfs profile survives. dup keeps two copies on
+// the same device, so it only guards against bad sectors.
+static int profileRedundancy(const QString &profile) {
+    static const QMap<QString, int> redundancy = {
+        {"single", 0}, {"dup", 0}, {"raid0", 0}, {"raid1", 1}, {"raid10", 1}, {"raid1c3", 2}
+    };
+    return redundancy.value(profile);
+}
+
+static QString diskLayoutError(const QMap<QString, QString> &settings) {
+    static const QMap<QString, int> minimumDisks = {
+        {"single", 1}, {"dup", 1}, {"raid0", 2}, {"raid1", 2}, {"raid10", 4}, {"raid1c3", 3}
+    };
+
+    // Every target runs the same plan, so they need the same number of disks.
+    QStringList groups = targetGroups(settings.value("targetDisk"));
+    QStringList seen;
+    int disks = groups.isEmpty() ? 0 : targetDisks(groups.first()).size();
+    for (const QString &group : groups) {
+        if (targetDisks(group).size() != disks) {
+            return QString("Every target needs the same number of disks");
+        }
+        for (const QString &disk : targetDisks(group)) {
+            if (seen.contains(disk)) {
+                return QString("%1 is used by more than one target").arg(disk);
+            }
+            seen << disk;
+        }
+    }
+    for (const QString &key : QStringList{"dataProfile", "metadataProfile"}) {
+        QString profile = settings.value(key);
+        if (!minimumDisks.contains(profile)) {
+            return QString("Unknown btrfs profile: %1").arg(profile);
+        }
+        if (disks < minimumDisks[profile]) {
+            return QString("The %1 profile needs at least %2 disks").arg(profile).arg(minimumDisks[profile]);
+        }
+    }
+    // Losing the metadata loses the whole filesystem, redundant data or not.
+    if (profileRedundancy(settings.value("metadataProfile")) < profileRedundancy(settings.value("dataProfile"))) {
+        return QString("The %1 metadata profile is less redundant than %2 data")
+            .arg(settings.value("metadataProfile"), settings.value("dataProfile"));
+    }
+    // Alpine's initramfs unlocks a single cryptroot device.
+    if (settings.value("encryption") == "luks2" && disks > 1) {
+        return QString("LUKS2 encryption supports a single target disk");
+    }
+    return QString();
+}
+
+struct BtrfsSubvolume {
+    QString name;
+    QString mountPoint;
+};
+
+static const QList<BtrfsSubvolume> btrfsSubvolumes = {
+    {"@", "/"},
+    {"@home", "/home"},
+    {"@root", "/root"},
+    {"@srv", "/srv"},
+    {"@tmp", "/tmp"},
+    {"@log", "/var/log"},
+    {"@cache", "/var/cache"},
+    {"@/var/lib/portables", "/var/lib/portables"},
+    {"@/var/lib/machines", "/var/lib/machines"}
+};
+
+// One step of an install plan. Either runs a command or, when `file` is set,
+// installs the generated file with that id.
+struct PlanOperation {
+    QString id;
+    QString stage;
+    QStringList dependsOn;
+    QString command;
+    QStringList args;
+    bool asRoot = true;
+    QString file;
+    // Prepares the installer host itself and runs once before any target.
+    bool hostScope = false;
+
+    bool writesFile() const { return !file.isEmpty(); }
+};
+
+struct GeneratedFile {
+    QString id;
+    QString path;
+    QString mode;
+    QString content;
+    // Holds a secret outside the target; removed when the session ends,
+    // whether or not the install succeeded.
+    bool temporary = false;
+};
+
+static quint32 crc32cSoftware(const uchar *data, size_t length) {
+    static const auto table = [] {
+        std::array<quint32, 256> entries{};
+        for (quint32 i = 0; i < 256; ++i) {
+            quint32 crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1u)));
+            }
+            entries[i] = crc;
+        }
+        return entries;
+    }();
+
+    quint32 crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static quint32 crc32cHardware(const uchar *data, size_t length) {
+    quint64 crc = 0xFFFFFFFFu;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        quint64 word;
+        memcpy(&word, data + i, sizeof(word));
+        crc = _mm_crc32_u64(crc, word);
+    }
+    for (; i < length; ++i) {
+        crc = _mm_crc32_u8(quint32(crc), data[i]);
+    }
+    return ~quint32(crc);
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static quint32 crc32cHardware(const uchar *data, size_t length) {
+    quint32 crc = 0xFFFFFFFFu;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        quint64 word;
+        memcpy(&word, data + i, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; i < length; ++i) {
+        crc = __crc32cb(crc, data[i]);
+    }
+    return ~crc;
+}
+#endif
+
+static quint64 xxhash64(const uchar *data, size_t length) {
+    const quint64 prime1 = 11400714785074694791ULL;
+    const quint64 prime2 = 14029467366897019727ULL;
+    const quint64 prime3 = 1609587929392839161ULL;
+    const quint64 prime4 = 9650029242287828579ULL;
+    const quint64 prime5 = 2870177450012600261ULL;
+
+    auto rotl = [](quint64 value, int bits) { return (value << bits) | (value >> (64 - bits)); };
+    auto read64 = [](const uchar *p) { quint64 value; memcpy(&value, p, sizeof(value)); return value; };
+    auto read32 = [](const uchar *p) { quint32 value; memcpy(&value, p, sizeof(value)); return value; };
+    auto mix = [&](quint64 acc, quint64 input) { return rotl(acc + input * prime2, 31) * prime1; };
+    auto merge = [&](quint64 acc, quint64 value) { return (acc ^ mix(0, value)) * prime1 + prime4; };
+
+    const uchar *p = data;
+    const uchar *end = data + length;
+    quint64 hash;
+
+    if (length >= 32) {
+        quint64 v1 = prime1 + prime2;
+        quint64 v2 = prime2;
+        quint64 v3 = 0;
+        quint64 v4 = 0 - prime1;
+        do {
+            v1 = mix(v1, read64(p));
+            v2 = mix(v2, read64(p + 8));
+            v3 = mix(v3, read64(p + 16));
+            v4 = mix(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        hash = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        hash = merge(hash, v1);
+        hash = merge(hash, v2);
+        hash = merge(hash, v3);
+        hash = merge(hash, v4);
+    } else {
+        hash = prime5;
+    }
+
+    hash += length;
+    for (; p + 8 <= end; p += 8) {
+        hash = rotl(hash ^ mix(0, read64(p)), 27) * prime1 + prime4;
+    }
+    if (p + 4 <= end) {
+        hash = rotl(hash ^ (quint64(read32(p)) * prime1), 23) * prime2 + prime3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        hash = rotl(hash ^ (*p * prime5), 11) * prime1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+struct ChecksumBenchmark {
+    QString name;
+    double megabytesPerSecond;
+};
+
+// mkfs.btrfs choices for this machine: checksum from a quick in-process
+// benchmark of the algorithms btrfs supports, features from the running
+// kernel and node size from the target device.
+class BtrfsTuning {
+public:
+    static BtrfsTuning detect(const QString &targetDisk) {
+        BtrfsTuning tuning;
+        tuning.cpuFeatures = detectCpuFeatures();
+
+        QByteArray buffer(256 * 1024, Qt::Uninitialized);
+        for (int i = 0; i < buffer.size(); ++i) {
+            buffer[i] = char((i * 2654435761u) >> 24);
+        }
+        const uchar *data = reinterpret_cast<const uchar *>(buffer.constData());
+        const size_t size = buffer.size();
+
+        [[maybe_unused]] bool crcInstructions = tuning.cpuFeatures.contains("sse4_2") || tuning.cpuFeatures.contains("crc32");
+        tuning.benchmark << measure("crc32c", buffer.size(), [&]() {
+#if defined(__x86_64__) || defined(__aarch64__)
+            if (crcInstructions) return quint64(crc32cHardware(data, size));
+#endif
+            return quint64(crc32cSoftware(data, size));
+        });
+        tuning.benchmark << measure("xxhash", buffer.size(), [&]() {
+            return xxhash64(data, size);
+        });
+        tuning.benchmark << measure("sha256", buffer.size(), [&]() {
+            return quint64(QCryptographicHash::hash(buffer, QCryptographicHash::Sha256).at(0));
+        });
+        tuning.benchmark << measure("blake2b", buffer.size(), [&]() {
+            return quint64(QCryptographicHash::hash(buffer, QCryptographicHash::Blake2b_256).at(0));
+        });
+
+        ChecksumBenchmark fastest = tuning.benchmark.first();
+        for (const ChecksumBenchmark &result : tuning.benchmark) {
+            if (result.megabytesPerSecond > fastest.megabytesPerSecond) fastest = result;
+        }
+        tuning.checksum = fastest.name;
+
+        // block-group-tree needs kernel 6.1 and a mkfs.btrfs that knows it, and
+        // builds on free-space-tree and no-holes.
+        tuning.features = "no-holes,free-space-tree";
+        QVersionNumber kernel = QVersionNumber::fromString(QSysInfo::kernelVersion());
+        if (kernel >= QVersionNumber(6, 1) && mkfsFeatures().contains("block-group-tree")) {
+            tuning.features += ",block-group-tree";
+        }
+
+        return tuning.forDisks(targetDisk);
+    }
+
+    // The CPU results hold for every target; the device class and node size
+    // belong to the disks of one target.
+    BtrfsTuning forDisks(const QString &targetDisk) const {
+        BtrfsTuning tuning = *this;
+        tuning.rotational = false;
+        for (const QString &disk : targetDisks(targetDisk)) {
+            QFile rotationalFile(QString("/sys/block/%1/queue/rotational").arg(QFileInfo(disk).fileName()));
+            if (rotationalFile.open(QIODevice::ReadOnly) && rotationalFile.readAll().trimmed() == "1") {
+                tuning.rotational = true;
+            }
+        }
+        long pageSize = sysconf(_SC_PAGESIZE);
+        tuning.nodesize = QString::number(qMax<long>(tuning.rotational ? 32768 : 16384, pageSize));
+        return tuning;
+    }
+
+    // Only fills values that were not set explicitly, e.g. with --set.
+    void fillSettings(QMap<QString, QString> &settings) const {
+        if (settings.value("checksum").isEmpty()) settings["checksum"] = checksum;
+        if (settings.value("btrfsFeatures").isEmpty()) settings["btrfsFeatures"] = features;
+        if (settings.value("nodesize").isEmpty()) settings["nodesize"] = nodesize;
+    }
+
+    QString summary() const {
+        QStringList results;
+        for (const ChecksumBenchmark &result : benchmark) {
+            results << QString("%1 %2 MB/s").arg(result.name).arg(qRound(result.megabytesPerSecond));
+        }
+        QStringList accelerated;
+        for (const QString &flag : QStringList{"sse4_2", "avx2", "sha_ni", "crc32", "sha2"}) {
+            if (cpuFeatures.contains(flag)) accelerated << flag;
+        }
+        return QString("CPU: %1\nChecksum speed: %2\nDevice: %3")
+            .arg(accelerated.isEmpty() ? "no checksum acceleration" : accelerated.join(" "),
+                 results.join(", "),
+                 rotational ? "rotational" : "solid state");
+    }
+
+    QString checksum;
+    QString features;
+    QString nodesize;
+    QStringList cpuFeatures;
+    QList<ChecksumBenchmark> benchmark;
+    bool rotational = false;
+
+private:
+    // mkfs.btrfs -O list-all prints the supported features on stderr.
+    static QString mkfsFeatures() {
+        QProcess mkfs;
+        mkfs.setProcessChannelMode(QProcess::MergedChannels);
+        mkfs.start("mkfs.btrfs", {"-O", "list-all"});
+        if (!mkfs.waitForFinished()) return QString();
+        return QString::fromLocal8Bit(mkfs.readAll());
+    }
+
+    static QStringList detectCpuFeatures() {
+        QFile cpuinfo("/proc/cpuinfo");
+        if (!cpuinfo.open(QIODevice::ReadOnly | QIODevice::Text)) return {};
+
+        QTextStream in(&cpuinfo);
+        QString line;
+        while (in.readLineInto(&line)) {
+            if (line.startsWith("flags") || line.startsWith("Features")) {
+                return line.section(':', 1).split(' ', Qt::SkipEmptyParts);
+            }
+        }
+        return {};
+    }
+
+    template <typename Hash>
+    static ChecksumBenchmark measure(const QString &name, qint64 bytesPerRun, Hash hash) {
+        volatile quint64 sink = 0;
+        qint64 bytes = 0;
+        QElapsedTimer timer;
+        timer.start();
+        do {
+            sink = sink + hash();
+            bytes += bytesPerRun;
+        } while (timer.nsecsElapsed() < 10000000);
+        return {name, bytes / (timer.nsecsElapsed() / 1e9) / 1e6};
+    }
+};
+
+struct CipherBenchmark {
+    QString cipher;
+    int keySize;
+    double megabytesPerSecond;
+};
+
+// dm-crypt settings for this machine. Like `cryptsetup benchmark`, the
+// ciphers are timed through the kernel's own implementations via AF_ALG, so
+// AES-NI/ARMv8 crypto extensions are reflected; without AF_ALG the CPU
+// flags decide.
+class LuksTuning {
+public:
+    static LuksTuning detect(const QStringList &cpuFeatures, bool rotational) {
+        LuksTuning tuning;
+        tuning.benchmark << CipherBenchmark{"aes-xts-plain64", 512, kernelCipherSpeed("xts(aes)", 64, 16)};
+        tuning.benchmark << CipherBenchmark{"xchacha12,aes-adiantum-plain64", 256,
+                                            kernelCipherSpeed("adiantum(xchacha12,aes)", 32, 32)};
+
+        const CipherBenchmark &xts = tuning.benchmark[0];
+        const CipherBenchmark &adiantum = tuning.benchmark[1];
+        tuning.measured = xts.megabytesPerSecond > 0 || adiantum.megabytesPerSecond > 0;
+        bool useXts = tuning.measured ? xts.megabytesPerSecond >= adiantum.megabytesPerSecond
+                                      : cpuFeatures.contains("aes");
+        tuning.cipher = useXts ? xts.cipher : adiantum.cipher;
+        tuning.keySize = QString::number(useXts ? xts.keySize : adiantum.keySize);
+
+        return tuning.forDevice(rotational);
+    }
+
+    // The dm-crypt workqueues only pay off on rotational disks; on flash
+    // they add latency and cap throughput.
+    LuksTuning forDevice(bool rotational) const {
+        LuksTuning tuning = *this;
+        tuning.bypassWorkqueues = !rotational;
+        return tuning;
+    }
+
+    // Only fills values that were not set explicitly, e.g. with --set.
+    void fillSettings(QMap<QString, QString> &settings) const {
+        if (settings.value("cipher").isEmpty()) {
+            settings["cipher"] = cipher;
+            settings["cipherKeySize"] = keySize;
+        }
+        if (!settings.contains("cryptNoReadWorkqueue")) {
+            settings["cryptNoReadWorkqueue"] = bypassWorkqueues ? "--perf-no_read_workqueue" : "";
+        }
+        if (!settings.contains("cryptNoWriteWorkqueue")) {
+            settings["cryptNoWriteWorkqueue"] = bypassWorkqueues ? "--perf-no_write_workqueue" : "";
+        }
+    }
+
+    QString summary() const {
+        QStringList results;
+        for (const CipherBenchmark &result : benchmark) {
+            results << QString("%1 %2 MB/s").arg(result.cipher).arg(qRound(result.megabytesPerSecond));
+        }
+        return QString("Cipher speed: %1\ndm-crypt workqueues: %2")
+            .arg(measured ? results.join(", ") : "kernel benchmark unavailable, chosen from CPU flags",
+                 bypassWorkqueues ? "bypassed" : "kept");
+    }
+
+    QString cipher;
+    QString keySize;
+    QList<CipherBenchmark> benchmark;
+    bool measured = false;
+    bool bypassWorkqueues = false;
+
+private:
+    static double kernelCipherSpeed(const char *algorithm, int keyBytes, int ivBytes) {
+        int tfm = socket(AF_ALG, SOCK_SEQPACKET, 0);
+        if (tfm < 0) return 0;
+
+        sockaddr_alg address = {};
+        address.salg_family = AF_ALG;
+        strcpy(reinterpret_cast<char *>(address.salg_type), "skcipher");
+        strncpy(reinterpret_cast<char *>(address.salg_name), algorithm, sizeof(address.salg_name) - 1);
+
+        // XTS rejects keys whose two halves are identical.
+        QByteArray key(keyBytes, Qt::Uninitialized);
+        for (int i = 0; i < keyBytes; ++i) {
+            key[i] = char(i * 7 + 1);
+        }
+
+        int op = -1;
+        if (bind(tfm, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0
+            || setsockopt(tfm, SOL_ALG, ALG_SET_KEY, key.constData(), key.size()) < 0
+            || (op = accept(tfm, nullptr, nullptr)) < 0) {
+            close(tfm);
+            return 0;
+        }
+
+        QByteArray input(64 * 1024, '\0');
+        QByteArray output(input.size(), Qt::Uninitialized);
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(quint32)) + CMSG_SPACE(sizeof(af_alg_iv) + 32)] = {};
+
+        iovec io = {input.data(), size_t(input.size())};
+        msghdr message = {};
+        message.msg_iov = &io;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(sizeof(quint32)) + CMSG_SPACE(sizeof(af_alg_iv) + ivBytes);
+
+        cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_ALG;
+        header->cmsg_type = ALG_SET_OP;
+        header->cmsg_len = CMSG_LEN(sizeof(quint32));
+        quint32 operation = ALG_OP_ENCRYPT;
+        memcpy(CMSG_DATA(header), &operation, sizeof(operation));
+
+        header = CMSG_NXTHDR(&message, header);
+        header->cmsg_level = SOL_ALG;
+        header->cmsg_type = ALG_SET_IV;
+        header->cmsg_len = CMSG_LEN(sizeof(af_alg_iv) + ivBytes);
+        reinterpret_cast<af_alg_iv *>(CMSG_DATA(header))->ivlen = ivBytes;
+
+        qint64 bytes = 0;
+        QElapsedTimer timer;
+        timer.start();
+        do {
+            if (sendmsg(op, &message, 0) != input.size() || read(op, output.data(), output.size()) != output.size()) {
+                bytes = 0;
+                break;
+            }
+            bytes += input.size();
+        } while (timer.nsecsElapsed() < 20000000);
+
+        qint64 elapsed = timer.nsecsElapsed();
+        close(op);
+        close(tfm);
+        return bytes / (elapsed / 1e9) / 1e6;
+    }
+};
+
+// A system installed earlier by this installer: an ESP and a btrfs (or LUKS2)
+// partition on every disk. Reinstalling in place keeps their ids, so the new
+// fstab and bootloader entry match the filesystem that stays on disk.
+class ExistingInstall {
+public:
+    static ExistingInstall detect(const QStringList &disks, bool encrypted, const QString &passphrase) {
+        ExistingInstall install;
+        for (int i = 0; i < disks.size(); ++i) {
+            QString prefix = QString("disk%1").arg(i + 1);
+            QString esp = partitionPath(disks[i], 1);
+            QString root = partitionPath(disks[i], 2);
+
+            if (probe(esp, "TYPE") != "vfat") {
+                install.error = QString("%1 is not an EFI system partition made by this installer").arg(esp);
+                return install;
+            }
+            QString espUuid = probe(esp, "UUID");
+            install.values[prefix + ".espUuid"] = espUuid;
+            install.values[prefix + ".espId"] = QString(espUuid).remove('-');
+
+            QString mapping;
+            if (encrypted) {
+                if (probe(root, "TYPE") != "crypto_LUKS") {
+                    install.error = QString("%1 is not a LUKS2 partition").arg(root);
+                    return install;
+                }
+                install.values["luksUuid"] = probe(root, "UUID");
+                mapping = unlock(root, passphrase);
+                if (mapping.isEmpty()) {
+                    install.error = QString("Cannot unlock %1 with the encryption passphrase").arg(root);
+                    return install;
+                }
+                root = "/dev/mapper/" + mapping;
+            }
+
+            QString type = probe(root, "TYPE");
+            QString uuid = probe(root, "UUID");
+            if (!mapping.isEmpty()) {
+                QProcess::execute("cryptsetup", {"close", mapping});
+            }
+            if (type != "btrfs") {
+                install.error = QString("%1 does not hold a btrfs filesystem").arg(root);
+                return install;
+            }
+            if (install.values.contains("rootUuid") && install.values["rootUuid"] != uuid) {
+                install.error = QString("%1 belongs to a different btrfs filesystem").arg(root);
+                return install;
+            }
+            install.values["rootUuid"] = uuid;
+        }
+        return install;
+    }
+
+    void fillSettings(QMap<QString, QString> &settings) const {
+        for (auto it = values.cbegin(); it != values.cend(); ++it) {
+            settings[it.key()] = it.value();
+        }
+    }
+
+    QString summary() const {
+        return QString("Existing filesystem: %1").arg(values.value("rootUuid"));
+    }
+
+    QMap<QString, QString> values;
+    QString error;
+
+private:
+    static QString probe(const QString &device, const QString &tag) {
+        QProcess blkid;
+        blkid.start("blkid", {"-p", "-o", "value", "-s", tag, device});
+        blkid.waitForFinished();
+        return QString::fromLocal8Bit(blkid.readAllStandardOutput()).trimmed();
+    }
+
+    // Opened read-only just long enough to read the btrfs UUID.
+    static QString unlock(const QString &device, const QString &passphrase) {
+        QTemporaryFile keyFile;
+        if (!keyFile.open()) return QString();
+        keyFile.write(passphrase.toUtf8());
+        keyFile.close();
+
+        QString mapping = "alpine-installer-probe";
+        if (QProcess::execute("cryptsetup", {"open", "--readonly", "--key-file", keyFile.fileName(), device, mapping}) != 0) {
+            return QString();
+        }
+        return mapping;
+    }
+};
+
+// The whole installation compiled from the settings map before anything runs.
+// Host-specific values are kept as ${key} placeholders so a saved plan can be
+// reviewed, diffed and replayed on another machine.
+class InstallPlan {
+public:
+    static constexpr int formatVersion = 1;
+
+    static inline const QString sharedPackageCache = "/var/cache/alpine-installer/apk";
+
+    static QStringList hostKeys() {
+        return QStringList{"targetDisk", "hostname", "rootPassword", "userPassword", "encryptionPassword"}
+            + detectedKeys();
+    }
+
+    // Host values measured on the machine doing the install (see BtrfsTuning
+    // and LuksTuning) rather than configured, so a replayed plan detects them
+    // again. They are not stored in the plan.
+    static QStringList detectedKeys() {
+        return {"checksum", "btrfsFeatures", "nodesize",
+                "cipher", "cipherKeySize", "cryptNoReadWorkqueue", "cryptNoWriteWorkqueue"};
+    }
+
+    // Mount root and session number of one target, assigned by
+    // targetSettings() for every run and never stored in the plan.
+    static QStringList sessionKeys() {
+        return {"root", "session"};
+    }
+
+    // Never written to a plan file or printed by --dry-run.
+    static QStringList secretKeys() {
+        return {"rootPassword", "userPassword", "encryptionPassword"};
+    }
+
+    // The subset of `keys` that must be set before installing. Detected
+    // values are filled in later and the passphrase only matters with LUKS2.
+    static QStringList requiredKeys(QStringList keys, const QString &encryption) {
+        for (const QString &key : detectedKeys()) {
+            keys.removeAll(key);
+        }
+        keys.removeAll("encryptionPassword");
+        if (encryption == "luks2") {
+            keys << "encryptionPassword";
+        }
+        return keys;
+    }
+
+    static InstallPlan compile(const QMap<QString, QString> &settings) {
+        InstallPlan plan;
+        for (auto it = settings.cbegin(); it != settings.cend(); ++it) {
+            if (sessionKeys().contains(it.key())) {
+                continue;
+            } else if (!hostKeys().contains(it.key())) {
+                plan.settings[it.key()] = it.value();
+            } else if (!secretKeys().contains(it.key()) && !detectedKeys().contains(it.key())) {
+                plan.host[it.key()] = it.value();
+            }
+        }
+
+        // Disk paths, partitions and filesystem ids are host values derived
+        // in hostValues(); only the number of disks is part of the plan.
+        int diskCount = qMax(1, int(targetDisks(settings["targetDisk"]).size()));
+        plan.settings["diskCount"] = QString::number(diskCount);
+        auto disk = [](int i, const QString &field = QString()) {
+            return QString("${disk%1%2}").arg(i).arg(field.isEmpty() ? QString() : "." + field);
+        };
+        bool encrypted = settings["encryption"] == "luks2";
+        // A reinstall keeps the partitions, the LUKS2 header and the btrfs
+        // filesystem and only replaces @ (see the "Replacing root subvolume" stage).
+        bool reinstall = settings.value("installMode") == "reinstall";
+        QString cryptName = "cryptroot-${session}";
+        QString rootDevice = encrypted ? "/dev/mapper/" + cryptName : disk(1, "root");
+        QString keyFile = "/tmp/alpine-installer-luks-${session}.key";
+        QString compression = "zstd:" + settings["compressionLevel"];
+
+        // Files written during the install can use a cheaper setting; fstab
+        // always gets the target level and a first-boot job recompresses.
+        QString installCompression = settings.value("installCompression", "target");
+        bool recompress = installCompression != "target" && installCompression != compression;
+        if (!recompress) {
+            installCompression = compression;
+        }
+        auto mountOptions = [&installCompression](const QString &subvolume) {
+            if (installCompression == "none") {
+                return QString("subvol=%1").arg(subvolume);
+            }
+            return QString("subvol=%1,compress=%2,compress-force=%2").arg(subvolume, installCompression);
+        };
+
+        plan.packageSets["host-tools"] = {"btrfs-progs", "parted", "dosfstools", "efibootmgr"};
+        if (encrypted) {
+            plan.packageSets["host-tools"] << "cryptsetup";
+            plan.packageSets["encryption"] = {"cryptsetup"};
+        }
+
+        QString desktop;
+        QString loginManager = "none";
+        if (settings["desktopEnv"] == "KDE Plasma") {
+            desktop = "plasma";
+            plan.packageSets["network"] = {"plasma-nm"};
+            loginManager = "sddm";
+        } else if (settings["desktopEnv"] == "GNOME") {
+            desktop = "gnome";
+            plan.packageSets["network"] = {"networkmanager-gnome"};
+            loginManager = "gdm";
+        } else if (settings["desktopEnv"] == "XFCE") {
+            desktop = "xfce";
+            plan.packageSets["network"] = {"networkmanager-gtk"};
+            loginManager = "lightdm";
+        } else if (settings["desktopEnv"] == "MATE") {
+            desktop = "mate";
+            plan.packageSets["network"] = {"networkmanager-gtk"};
+            loginManager = "lightdm";
+        } else if (settings["desktopEnv"] == "LXQt") {
+            desktop = "lxqt";
+            plan.packageSets["network"] = {"networkmanager-qt"};
+            loginManager = "lightdm";
+        } else {
+            plan.packageSets["network"] = {"networkmanager"};
+        }
+
+        if (settings["bootloader"] == "GRUB") {
+            plan.packageSets["bootloader"] = {"grub-efi"};
+        } else if (settings["bootloader"] == "rEFInd") {
+            plan.packageSets["bootloader"] = {"refind"};
+        }
+
+        if (settings["initSystem"] == "sysvinit") {
+            plan.packageSets["init"] = {"sysvinit", "openrc"};
+        } else if (settings["initSystem"] == "runit") {
+            plan.packageSets["init"] = {"runit", "runit-openrc"};
+        } else if (settings["initSystem"] == "s6") {
+            plan.packageSets["init"] = {"s6", "s6-openrc"};
+        }
+
+        if (recompress) {
+            plan.packageSets["recompress"] = {"compsize"};
+        }
+
+        QString fstab;
+        QTextStream fstabOut(&fstab);
+        for (int i = 1; i <= diskCount; ++i) {
+            fstabOut << "UUID=" << disk(i, "espUuid") << " " << espMountPoint(i, encrypted)
+                     << (i == 1 ? " vfat defaults 0 2\n" : " vfat defaults,nofail 0 2\n");
+        }
+        for (const BtrfsSubvolume &subvolume : btrfsSubvolumes) {
+            fstabOut << "UUID=${rootUuid} " << subvolume.mountPoint << " btrfs rw,noatime,compress=" << compression
+                     << ",compress-force=" << compression << ",subvol=" << subvolume.name
+                     << (subvolume.name == "@" ? " 0 1\n" : " 0 2\n");
+        }
+        fstabOut.flush();
+        plan.files << GeneratedFile{"fstab", "${root}/etc/fstab", "0644", fstab};
+        plan.files << GeneratedFile{"setup-chroot", "${root}/setup-chroot.sh", "0755",
+                                    chrootScript(settings, plan.packageSets, desktop, loginManager, diskCount, reinstall)};
+        if (encrypted) {
+            // The passphrase only reaches disk at install time, the plan keeps the placeholder.
+            plan.files << GeneratedFile{"luks-key", keyFile, "0600", "${encryptionPassword}", true};
+        }
+        if (recompress) {
+            plan.files << GeneratedFile{"recompress", "${root}/usr/local/sbin/btrfs-recompress", "0755",
+                                        recompressScript(settings["compressionLevel"], reinstall)};
+            plan.files << GeneratedFile{"recompress-hook", "${root}/etc/local.d/btrfs-recompress.start", "0755",
+                                        "#!/bin/ash\n"
+                                        "# Background recompression after a fast install, see btrfs-recompress.\n"
+                                        "[ -e /var/lib/btrfs-recompress.done ] || /usr/local/sbin/btrfs-recompress &\n"};
+        }
+
+        QString stage;
+        auto add = [&plan, &stage](const QString &id, const QStringList &dependsOn,
+                                   const QString &command = QString(), const QStringList &args = QStringList()) -> PlanOperation & {
+            PlanOperation op;
+            op.id = id;
+            op.stage = stage;
+            op.dependsOn = dependsOn;
+            op.command = command;
+            op.args = args;
+            plan.operations << op;
+            return plan.operations.last();
+        };
+
+        stage = "Installing required tools...";
+        add("tools.install", {}, "apk", QStringList{"add"} + plan.packageSets["host-tools"]).hostScope = true;
+
+        stage = "Loading BTRFS module...";
+        add("btrfs.load", {"tools.install"}, "modprobe", {"btrfs"}).hostScope = true;
+        if (encrypted) {
+            add("crypt.load", {"tools.install"}, "modprobe", {"dm_crypt"}).hostScope = true;
+        }
+
+        // Every target links its apk cache to this directory, so packages are
+        // downloaded once however many disks are installed in parallel.
+        stage = "Preparing shared package cache...";
+        add("cache.prepare", {}, "mkdir", {"-p", sharedPackageCache}).hostScope = true;
+
+        if (!reinstall) {
+            stage = diskCount == 1 ? "Partitioning disk..." : "Partitioning disks...";
+            for (int i = 1; i <= diskCount; ++i) {
+                QString id = QString("disk%1").arg(i);
+                add(id + ".label", {"tools.install"}, "parted", {"-s", disk(i), "mklabel", "gpt"});
+                add(id + ".esp", {id + ".label"}, "parted", {"-s", disk(i), "mkpart", "primary", "1MiB", "513MiB"});
+                add(id + ".esp-flag", {id + ".esp"}, "parted", {"-s", disk(i), "set", "1", "esp", "on"});
+                add(id + ".root", {id + ".esp"}, "parted", {"-s", disk(i), "mkpart", "primary", "513MiB", "100%"});
+            }
+        }
+
+        QStringList rootPartitions;
+        QStringList rootDependencies = {"btrfs.load"};
+        if (encrypted) {
+            stage = reinstall ? "Unlocking encrypted root..." : "Setting up encryption...";
+            add("crypt.key", {reinstall ? "tools.install" : "disk1.root"}).file = "luks-key";
+            if (!reinstall) {
+                add("crypt.format", {"crypt.key", "crypt.load"}, "cryptsetup",
+                    {"luksFormat", "--batch-mode", "--type", "luks2", "--cipher", "${cipher}", "--key-size", "${cipherKeySize}",
+                     "--sector-size", "4096", "--pbkdf", "argon2id", "--uuid", "${luksUuid}", "--key-file", keyFile, disk(1, "root")});
+            }
+            // --persistent writes the workqueue flags into the LUKS2 header, which
+            // a reinstall leaves exactly as it found it.
+            QStringList openArgs = {"open", "--key-file", keyFile};
+            if (!reinstall) {
+                openArgs << "--persistent" << "${cryptNoReadWorkqueue}" << "${cryptNoWriteWorkqueue}";
+            }
+            add("crypt.open", {reinstall ? "crypt.key" : "crypt.format", "crypt.load"}, "cryptsetup",
+                openArgs + QStringList{disk(1, "root"), cryptName});
+            add("crypt.forget-key", {"crypt.open"}, "rm", {"-f", keyFile});
+            rootPartitions << rootDevice;
+            rootDependencies << "crypt.open";
+        }
+
+        stage = reinstall ? "Scanning existing filesystem..." : "Formatting partitions...";
+        for (int i = 1; i <= diskCount; ++i) {
+            QString id = QString("disk%1").arg(i);
+            if (!reinstall) {
+                add(QString("format.esp%1").arg(i), {id + ".esp-flag"}, "mkfs.vfat", {"-F32", "-i", disk(i, "espId"), disk(i, "esp")});
+            }
+            if (!encrypted) {
+                rootPartitions << disk(i, "root");
+                rootDependencies << (reinstall ? "tools.install" : id + ".root");
+            }
+        }
+        if (reinstall) {
+            add("format.scan", rootDependencies, "btrfs", {"device", "scan"});
+        } else {
+            add("format.root", rootDependencies, "mkfs.btrfs",
+                QStringList{"-f", "--csum", "${checksum}", "--features", "${btrfsFeatures}", "--nodesize", "${nodesize}",
+                            "--data", settings["dataProfile"], "--metadata", settings["metadataProfile"],
+                            "--uuid", "${rootUuid}"} + rootPartitions);
+            add("format.scan", {"format.root"}, "btrfs", {"device", "scan"});
+        }
+
+        stage = reinstall ? "Checking existing subvolumes..." : "Creating BTRFS subvolumes...";
+        add("root.create", {}, "mkdir", {"-p", "${root}"});
+        add("subvolumes.mount", {"format.scan", "root.create"}, "mount", {"-o", "subvolid=5", rootDevice, "${root}"});
+        QStringList created;
+        if (reinstall) {
+            // Nothing is touched unless the whole layout from a previous
+            // install is there.
+            QStringList checked;
+            for (const BtrfsSubvolume &subvolume : btrfsSubvolumes) {
+                add("existing." + subvolume.name, {"subvolumes.mount"}, "btrfs",
+                    {"subvolume", "show", "${root}/" + subvolume.name});
+                checked << "existing." + subvolume.name;
+            }
+
+            // The ESP only holds the bootloader and, with LUKS2, the kernel, so
+            // it is formatted again with its old volume id.
+            stage = "Rewriting EFI system partitions...";
+            for (int i = 1; i <= diskCount; ++i) {
+                add(QString("format.esp%1").arg(i), checked, "mkfs.vfat", {"-F32", "-i", disk(i, "espId"), disk(i, "esp")});
+            }
+
+            // The old @ is renamed rather than copied, which keeps it intact as
+            // a read-only snapshot for rollback. Nested subvolumes such as
+            // @/var/lib/machines move over to the new @ untouched.
+            stage = "Replacing root subvolume...";
+            QString previousRoot = "${root}/@.reinstall-${timestamp}";
+            add("snapshot.previous", checked, "mv", {"${root}/@", previousRoot});
+            add("subvolume.@", {"snapshot.previous"}, "btrfs", {"subvolume", "create", "${root}/@"});
+            created << "subvolume.@";
+            for (const BtrfsSubvolume &subvolume : btrfsSubvolumes) {
+                if (!subvolume.name.startsWith("@/")) continue;
+                QString id = "keep." + subvolume.name;
+                add(id + ".parent", {"subvolume.@"}, "mkdir", {"-p", "${root}/" + subvolume.name.section('/', 0, -2)});
+                add(id, {id + ".parent"}, "mv", {previousRoot + subvolume.mountPoint, "${root}/" + subvolume.name});
+                created << id;
+            }
+            add("snapshot.readonly", created, "btrfs", {"property", "set", "-t", "subvol", previousRoot, "ro", "true"});
+            created << "snapshot.readonly";
+        } else {
+            for (const BtrfsSubvolume &subvolume : btrfsSubvolumes) {
+                QString parent = "subvolumes.mount";
+                if (subvolume.name.startsWith("@/")) {
+                    // Nested subvolumes need their parent directories inside the new @.
+                    parent = "subvolume." + subvolume.name + ".parent";
+                    add(parent, {"subvolume.@"}, "mkdir", {"-p", "${root}/" + subvolume.name.section('/', 0, -2)});
+                }
+                add("subvolume." + subvolume.name, {parent}, "btrfs", {"subvolume", "create", "${root}/" + subvolume.name});
+                created << "subvolume." + subvolume.name;
+            }
+        }
+        add("subvolumes.umount", created, "umount", {"${root}"});
+
+        stage = "Remounting with compression...";
+        add("mount.@", {"subvolumes.umount"}, "mount", {"-o", mountOptions("@"), rootDevice, "${root}"});
+        QStringList directories;
+        for (int i = 1; i <= diskCount; ++i) {
+            directories << "${root}" + espMountPoint(i, encrypted);
+        }
+        for (const BtrfsSubvolume &subvolume : btrfsSubvolumes) {
+            if (subvolume.name != "@") directories << "${root}" + subvolume.mountPoint;
+        }
+        add("mount.directories", {"mount.@"}, "mkdir", QStringList{"-p"} + directories);
+        QStringList mounted;
+        for (int i = 1; i <= diskCount; ++i) {
+            QString id = QString("mount.esp%1").arg(i);
+            add(id, {"mount.directories", QString("format.esp%1").arg(i)}, "mount", {disk(i, "esp"), "${root}" + espMountPoint(i, encrypted)});
+            mounted << id;
+        }
+        for (const BtrfsSubvolume &subvolume : btrfsSubvolumes) {
+            if (subvolume.name == "@") continue;
+            add("mount." + subvolume.name, {"mount.directories"}, "mount",
+                {"-o", mountOptions(subvolume.name), rootDevice, "${root}" + subvolume.mountPoint});
+            mounted << "mount." + subvolume.name;
+        }
+
+        // A reinstall keeps @cache, so the packages of the previous install
+        // are reused from there instead of the shared host cache.
+        stage = reinstall ? "Reusing package cache..." : "Linking shared package cache...";
+        add("cache.directories", mounted, "mkdir", {"-p", "${root}/etc/apk", "${root}/var/cache/apk"});
+        add("cache.link", {"cache.directories"}, "ln", {"-sfn", "../../var/cache/apk", "${root}/etc/apk/cache"});
+        mounted << "cache.link";
+        if (!reinstall) {
+            add("cache.mount", {"cache.directories", "cache.prepare"}, "mount",
+                {"--bind", sharedPackageCache, "${root}/var/cache/apk"});
+            mounted << "cache.mount";
+        }
+
+        stage = "Installing base system...";
+        add("base.install", mounted, "setup-disk", {"-m", "sys", "${root}"});
+
+        stage = "Writing fstab...";
+        add("fstab.write", {"base.install"}).file = "fstab";
+
+        if (recompress) {
+            stage = "Scheduling background recompression...";
+            add("recompress.script", {"base.install"}).file = "recompress";
+            add("recompress.hook", {"base.install"}).file = "recompress-hook";
+        }
+
+        stage = "Preparing chroot environment...";
+        add("chroot.proc", {"base.install"}, "mount", {"-t", "proc", "none", "${root}/proc"});
+        add("chroot.dev", {"base.install"}, "mount", {"--rbind", "/dev", "${root}/dev"});
+        add("chroot.sys", {"base.install"}, "mount", {"--rbind", "/sys", "${root}/sys"});
+
+        stage = "Preparing chroot setup script...";
+        add("chroot.script", {"base.install"}).file = "setup-chroot";
+
+        stage = "Running chroot setup...";
+        add("chroot.run", {"chroot.proc", "chroot.dev", "chroot.sys", "chroot.script", "fstab.write"},
+            "chroot", {"${root}", "/setup-chroot.sh"});
+
+        stage = "Cleaning up...";
+        add("cleanup.umount", {"chroot.run"}, "umount", {"-R", "${root}"});
+        if (encrypted) {
+            add("cleanup.crypt", {"cleanup.umount"}, "cryptsetup", {"close", cryptName});
+        }
+
+        return plan;
+    }
+
+    // Host values for this run: the ones recorded in the plan, overridden by
+    // whatever is set on this machine.
+    QMap<QString, QString> hostValues(const QMap<QString, QString> &overrides) const {
+        QMap<QString, QString> values = host;
+        for (const QString &key : hostKeys()) {
+            if (!overrides.value(key).isEmpty()) {
+                values[key] = overrides.value(key);
+            }
+        }
+        // Detected values may be legitimately empty, e.g. optional cryptsetup flags.
+        for (const QString &key : detectedKeys()) {
+            if (overrides.contains(key)) {
+                values[key] = overrides.value(key);
+            }
+        }
+
+        // Fresh filesystem ids for every install so fstab and the bootloader
+        // can mount by UUID without probing the disks afterwards. A reinstall
+        // passes the ids found on disk instead (see ExistingInstall).
+        QStringList disks = targetDisks(values.value("targetDisk"));
+        for (int i = 0; i < disks.size(); ++i) {
+            QString prefix = QString("disk%1").arg(i + 1);
+            QString volumeId = QString("%1").arg(QRandomGenerator::global()->generate(), 8, 16, QChar('0')).toUpper();
+            values[prefix] = disks[i];
+            values[prefix + ".esp"] = partitionPath(disks[i], 1);
+            values[prefix + ".root"] = partitionPath(disks[i], 2);
+            values[prefix + ".espId"] = overrides.value(prefix + ".espId", volumeId);
+            values[prefix + ".espUuid"] = overrides.value(prefix + ".espUuid", volumeId.left(4) + "-" + volumeId.mid(4));
+        }
+        values["root"] = overrides.value("root", "/mnt");
+        values["session"] = overrides.value("session", "1");
+        values["rootUuid"] = overrides.value("rootUuid", QUuid::createUuid().toString(QUuid::WithoutBraces));
+        values["luksUuid"] = overrides.value("luksUuid", QUuid::createUuid().toString(QUuid::WithoutBraces));
+        values["timestamp"] = QDateTime::currentDateTimeUtc().toString("yyyyMMdd-HHmmss");
+        return values;
+    }
+
+    // Single pass, so a value that itself contains ${...} (a password, say)
+    // is inserted verbatim. Unknown placeholders are left as they are.
+    QString resolve(const QString &text, const QMap<QString, QString> &values) const {
+        static const QRegularExpression placeholder("\\$\\{([^}]+)\\}");
+        QString result;
+        qsizetype last = 0;
+        QRegularExpressionMatchIterator matches = placeholder.globalMatch(text);
+        while (matches.hasNext()) {
+            QRegularExpressionMatch match = matches.next();
+            result += text.mid(last, match.capturedStart() - last);
+            result += values.contains(match.captured(1)) ? values.value(match.captured(1)) : match.captured(0);
+            last = match.capturedEnd();
+        }
+        result += text.mid(last);
+        return result;
+    }
+
+    // An argument that is only a placeholder for an empty value is dropped,
+    // which is how optional flags are expressed in a plan.
+    QStringList resolve(const QStringList &args, const QMap<QString, QString> &values) const {
+        QStringList result;
+        for (const QString &arg : args) {
+            QString resolved = resolve(arg, values);
+            if (resolved.isEmpty() && arg.startsWith("${") && arg.endsWith("}")) continue;
+            result << resolved;
+        }
+        return result;
+    }
+
+    const GeneratedFile *generatedFile(const QString &id) const {
+        for (const GeneratedFile &file : files) {
+            if (file.id == id) return &file;
+        }
+        return nullptr;
+    }
+
+    QString describe(const QMap<QString, QString> &values) const {
+        QMap<QString, QString> shown = values;
+        for (const QString &key : secretKeys()) {
+            if (!shown.value(key).isEmpty()) shown[key] = "********";
+        }
+
+        QString text;
+        QTextStream out(&text);
+        out << "# Alpine Btrfs install plan (format " << formatVersion << ")\n\n";
+
+        out << "[host]\n";
+        for (const QString &key : hostKeys()) {
+            out << key << " = " << (shown.value(key).isEmpty() ? "${" + key + "}" : shown.value(key)) << "\n";
+        }
+
+        out << "\n[settings]\n";
+        for (auto it = settings.cbegin(); it != settings.cend(); ++it) {
+            out << it.key() << " = " << it.value() << "\n";
+        }
+
+        out << "\n[package sets]\n";
+        for (auto it = packageSets.cbegin(); it != packageSets.cend(); ++it) {
+            out << it.key() << ": " << it.value().join(" ") << "\n";
+        }
+
+        out << "\n[operations]\n";
+        for (int i = 0; i < operations.size(); ++i) {
+            const PlanOperation &op = operations[i];
+            QString action = op.writesFile()
+                ? "write " + resolve(generatedFile(op.file) ? generatedFile(op.file)->path : op.file, shown)
+                : (op.asRoot ? "doas " : "") + op.command + " " + resolve(op.args, shown).join(" ");
+            out << QString("%1. %2").arg(i + 1, 2).arg(op.id) << (op.hostScope ? " (host)" : "") << "\n";
+            out << "      " << action << "\n";
+            if (!op.dependsOn.isEmpty()) {
+                out << "      after: " << op.dependsOn.join(", ") << "\n";
+            }
+        }
+
+        for (const GeneratedFile &file : files) {
+            out << "\n[file " << file.id << " -> " << resolve(file.path, shown) << " mode " << file.mode << "]\n";
+            out << resolve(file.content, shown);
+        }
+        out.flush();
+        return text;
+    }
+
+    QJsonObject toJson() const {
+        QJsonObject json;
+        json["format"] = formatVersion;
+        json["settings"] = mapToJson(settings);
+        json["host"] = mapToJson(host);
+
+        QJsonObject sets;
+        for (auto it = packageSets.cbegin(); it != packageSets.cend(); ++it) {
+            sets[it.key()] = QJsonArray::fromStringList(it.value());
+        }
+        json["packageSets"] = sets;
+
+        QJsonArray fileArray;
+        for (const GeneratedFile &file : files) {
+            fileArray.append(QJsonObject{
+                {"id", file.id},
+                {"path", file.path},
+                {"mode", file.mode},
+                {"content", file.content},
+                {"temporary", file.temporary}
+            });
+        }
+        json["files"] = fileArray;
+
+        QJsonArray operationArray;
+        for (const PlanOperation &op : operations) {
+            QJsonObject entry{
+                {"id", op.id},
+                {"stage", op.stage},
+                {"dependsOn", QJsonArray::fromStringList(op.dependsOn)},
+                {"asRoot", op.asRoot}
+            };
+            if (op.hostScope) {
+                entry["scope"] = "host";
+            }
+            if (op.writesFile()) {
+                entry["file"] = op.file;
+            } else {
+                entry["command"] = op.command;
+                entry["args"] = QJsonArray::fromStringList(op.args);
+            }
+            operationArray.append(entry);
+        }
+        json["operations"] = operationArray;
+        return json;
+    }
+
+    static bool fromJson(const QJsonObject &json, InstallPlan *plan, QString *error) {
+        if (json["format"].toInt() != formatVersion) {
+            *error = QString("Unsupported plan format %1").arg(json["format"].toInt());
+            return false;
+        }
+
+        InstallPlan result;
+        result.settings = mapFromJson(json["settings"].toObject());
+        result.host = mapFromJson(json["host"].toObject());
+        for (const QString &key : secretKeys() + detectedKeys()) {
+            result.host.remove(key);
+        }
+
+        QJsonObject sets = json["packageSets"].toObject();
+        for (auto it = sets.constBegin(); it != sets.constEnd(); ++it) {
+            result.packageSets[it.key()] = stringList(it.value().toArray());
+        }
+
+        for (const QJsonValue &value : json["files"].toArray()) {
+            QJsonObject entry = value.toObject();
+            result.files << GeneratedFile{entry["id"].toString(), entry["path"].toString(),
+                                          entry["mode"].toString(), entry["content"].toString(),
+                                          entry["temporary"].toBool()};
+        }
+
+        for (const QJsonValue &value : json["operations"].toArray()) {
+            QJsonObject entry = value.toObject();
+            PlanOperation op;
+            op.id = entry["id"].toString();
+            op.stage = entry["stage"].toString();
+            op.dependsOn = stringList(entry["dependsOn"].toArray());
+            op.command = entry["command"].toString();
+            op.args = stringList(entry["args"].toArray());
+            op.asRoot = entry["asRoot"].toBool(true);
+            op.file = entry["file"].toString();
+            op.hostScope = entry["scope"].toString() == "host";
+            if (op.writesFile() && !result.generatedFile(op.file)) {
+                *error = QString("Operation %1 references unknown file %2").arg(op.id, op.file);
+                return false;
+            }
+            result.operations << op;
+        }
+
+        *plan = result;
+        return true;
+    }
+
+    bool save(const QString &path, QString *error) const {
+        QSaveFile file(path);
+        if (!file.open(QIODevice::WriteOnly)) {
+            *error = file.errorString();
+            return false;
+        }
+        file.write(QJsonDocument(toJson()).toJson(QJsonDocument::Indented));
+        if (!file.commit()) {
+            *error = file.errorString();
+            return false;
+        }
+        return true;
+    }
+
+    static bool load(const QString &path, InstallPlan *plan, QString *error) {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly)) {
+            *error = file.errorString();
+            return false;
+        }
+        QJsonParseError parseError;
+        QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &parseError);
+        if (document.isNull()) {
+            *error = parseError.errorString();
+            return false;
+        }
+        return fromJson(document.object(), plan, error);
+    }
+
+    QMap<QString, QString> settings;
+    QMap<QString, QString> host;
+    QMap<QString, QStringList> packageSets;
+    QList<GeneratedFile> files;
+    QList<PlanOperation> operations;
+
+private:
+    static QString chrootScript(const QMap<QString, QString> &settings,
+                                const QMap<QString, QStringList> &packageSets,
+                                const QString &desktop, const QString &loginManager, int diskCount, bool reinstall) {
+        QString script;
+        QTextStream out(&script);
+
+        out << "#!/bin/ash\n\n";
+        out << "# Basic system configuration\n";
+        out << "echo \"root:${rootPassword}\" | chpasswd\n";
+        // On a reinstall the home directory is still there in @home.
+        out << "adduser -D " << (reinstall ? "-H " : "") << settings["username"] << " -G wheel,video,audio,input\n";
+        out << "echo \"" << settings["username"] << ":${userPassword}\" | chpasswd\n";
+        out << "setup-timezone -z " << settings["timezone"] << "\n";
+        out << "setup-keymap " << settings["keymap"] << " " << settings["keymap"] << "\n";
+        out << "echo \"${hostname}\" > /etc/hostname\n\n";
+
+        out << "apk update\n";
+
+        if (desktop.isEmpty()) {
+            out << "echo \"No desktop environment selected\"\n";
+        } else {
+            out << "setup-desktop " << desktop << "\n";
+        }
+        out << "apk add " << packageSets["network"].join(" ") << "\n";
+
+        bool encrypted = settings["encryption"] == "luks2";
+        QString kernelOptions = "root=UUID=${rootUuid} rootfstype=btrfs rootflags=subvol=@ rw";
+        QStringList initramfsFeatures;
+        if (diskCount > 1) {
+            initramfsFeatures << "btrfs";
+        }
+        if (encrypted) {
+            out << "apk add " << packageSets["encryption"].join(" ") << "\n";
+            kernelOptions = "cryptroot=UUID=${luksUuid} cryptdm=cryptroot " + kernelOptions;
+            initramfsFeatures << "cryptsetup" << "keymap";
+        }
+        for (const QString &feature : initramfsFeatures) {
+            out << "grep -q 'features=\".*" << feature << "' /etc/mkinitfs/mkinitfs.conf || "
+                << "sed -i 's/^features=\"/features=\"" << feature << " /' /etc/mkinitfs/mkinitfs.conf\n";
+        }
+        if (!initramfsFeatures.isEmpty()) {
+            out << "mkinitfs $(ls /lib/modules | head -n 1)\n";
+        }
+
+        if (settings["bootloader"] == "GRUB") {
+            out << "apk add " << packageSets["bootloader"].join(" ") << "\n";
+            if (encrypted) {
+                out << "echo 'GRUB_CMDLINE_LINUX=\"cryptroot=UUID=${luksUuid} cryptdm=cryptroot\"' >> /etc/default/grub\n";
+            }
+            out << "grub-install --target=x86_64-efi --efi-directory=" << espMountPoint(1, encrypted) << " --bootloader-id=ALPINE\n";
+            for (int i = 2; i <= diskCount; ++i) {
+                out << "grub-install --target=x86_64-efi --efi-directory=" << espMountPoint(i)
+                    << " --bootloader-id=ALPINE-" << i << "\n";
+            }
+            out << "grub-mkconfig -o /boot/grub/grub.cfg\n";
+        } else if (settings["bootloader"] == "rEFInd") {
+            out << "apk add " << packageSets["bootloader"].join(" ") << "\n";
+            out << "refind-install\n";
+            out << "echo '\"Boot with standard options\" \"" << kernelOptions << "\"' > /boot/refind_linux.conf\n";
+            for (int i = 2; i <= diskCount; ++i) {
+                out << "cp -a " << espMountPoint(1) << "/EFI " << espMountPoint(i) << "/\n";
+                out << "efibootmgr -c -d ${disk" << i << "} -p 1 -L \"rEFInd " << i
+                    << "\" -l '\\EFI\\refind\\refind_x64.efi'\n";
+            }
+        }
+
+        if (settings["initSystem"] == "OpenRC") {
+            out << "rc-update add dbus\n";
+            out << "rc-update add networkmanager\n";
+            if (loginManager != "none") {
+                out << "rc-update add " << loginManager << "\n";
+            }
+        } else if (settings["initSystem"] == "sysvinit") {
+            out << "apk add " << packageSets["init"].join(" ") << "\n";
+            out << "ln -sf /etc/inittab.sysvinit /etc/inittab\n";
+            if (loginManager != "none") {
+                out << "ln -s /etc/init.d/" << loginManager << " /etc/rc.d/\n";
+            }
+            out << "ln -s /etc/init.d/dbus /etc/rc.d/\n";
+            out << "ln -s /etc/init.d/networkmanager /etc/rc.d/\n";
+        } else if (settings["initSystem"] == "runit") {
+            out << "apk add " << packageSets["init"].join(" ") << "\n";
+            out << "mkdir -p /etc/service\n";
+            if (loginManager != "none") {
+                out << "mkdir -p /etc/service/" << loginManager << "\n";
+                out << "echo '#!/bin/sh' > /etc/service/" << loginManager << "/run\n";
+                out << "echo 'exec /etc/init.d/" << loginManager << " start' >> /etc/service/" << loginManager << "/run\n";
+                out << "chmod +x /etc/service/" << loginManager << "/run\n";
+            }
+            out << "mkdir -p /etc/service/dbus\n";
+            out << "echo '#!/bin/sh' > /etc/service/dbus/run\n";
+            out << "echo 'exec /etc/init.d/dbus start' >> /etc/service/dbus/run\n";
+            out << "chmod +x /etc/service/dbus/run\n";
+        } else if (settings["initSystem"] == "s6") {
+            out << "apk add " << packageSets["init"].join(" ") << "\n";
+            out << "mkdir -p /etc/s6/sv\n";
+            if (loginManager != "none") {
+                out << "mkdir -p /etc/s6/sv/" << loginManager << "\n";
+                out << "echo '#!/bin/sh' > /etc/s6/sv/" << loginManager << "/run\n";
+                out << "echo 'exec /etc/init.d/" << loginManager << " start' >> /etc/s6/sv/" << loginManager << "/run\n";
+                out << "chmod +x /etc/s6/sv/" << loginManager << "/run\n";
+            }
+            out << "mkdir -p /etc/s6/sv/dbus\n";
+            out << "echo '#!/bin/sh' > /etc/s6/sv/dbus/run\n";
+            out << "echo 'exec /etc/init.d/dbus start' >> /etc/s6/sv/dbus/run\n";
+            out << "chmod +x /etc/s6/sv/dbus/run\n";
+        }
+
+        if (!packageSets["recompress"].isEmpty()) {
+            out << "apk add " << packageSets["recompress"].join(" ") << "\n";
+            if (settings["initSystem"] == "OpenRC") {
+                out << "rc-update add local default\n";
+            } else if (settings["initSystem"] == "sysvinit") {
+                out << "ln -s /etc/init.d/local /etc/rc.d/\n";
+            } else if (settings["initSystem"] == "runit") {
+                out << "mkdir -p /etc/service/local\n";
+                out << "echo '#!/bin/sh' > /etc/service/local/run\n";
+                out << "echo 'exec /etc/init.d/local start' >> /etc/service/local/run\n";
+                out << "chmod +x /etc/service/local/run\n";
+            } else if (settings["initSystem"] == "s6") {
+                out << "mkdir -p /etc/s6/sv/local\n";
+                out << "echo '#!/bin/sh' > /etc/s6/sv/local/run\n";
+                out << "echo 'exec /etc/init.d/local start' >> /etc/s6/sv/local/run\n";
+                out << "chmod +x /etc/s6/sv/local/run\n";
+            }
+        }
+
+        out << "rm /setup-chroot.sh\n";
+        out.flush();
+        return script;
+    }
+
+    // Runs once on first boot at idle CPU/IO priority and logs progress and the
+    // compression ratio before and after to /var/log/btrfs-recompress.log.
+    // A reinstall only wrote the new @; rewriting the kept subvolumes would
+    // touch user data and break reflinks and snapshot sharing.
+    static QString recompressScript(const QString &level, bool reinstall) {
+        QStringList paths;
+        for (const BtrfsSubvolume &subvolume : btrfsSubvolumes) {
+            if (reinstall && subvolume.name != "@") continue;
+            if (subvolume.mountPoint != "/tmp") paths << subvolume.mountPoint;
+        }
+
+        QString script;
+        QTextStream out(&script);
+
+        out << "#!/bin/ash\n\n";
+        out << "LEVEL=" << level << "\n";
+        out << "PATHS=\"" << paths.join(" ") << "\"\n";
+        out << "MARKER=/var/lib/btrfs-recompress.done\n";
+        out << "LOG=/var/log/btrfs-recompress.log\n\n";
+        out << "[ -e \"$MARKER\" ] && exit 0\n";
+        out << "exec >> \"$LOG\" 2>&1\n\n";
+        out << "ratio() {\n";
+        out << "    compsize -x $PATHS 2>/dev/null | awk '/^TOTAL/ { print $2 }'\n";
+        out << "}\n\n";
+        out << "renice -n 19 -p $$ > /dev/null\n";
+        out << "command -v ionice > /dev/null && ionice -c 3 -p $$\n\n";
+        out << "echo \"$(date) recompressing to zstd:$LEVEL, ratio before: $(ratio)\"\n";
+        // defragment -L needs recent btrfs-progs and kernel. Without it -czstd
+        // alone still rewrites every extent, and the kernel takes the level
+        // from the compress-force=zstd:<level> mount option in fstab.
+        out << "LEVEL_FLAGS=\"\"\n";
+        out << "btrfs filesystem defragment --help 2>&1 | grep -q -- '--level' && LEVEL_FLAGS=\"-czstd -L $LEVEL\"\n";
+        out << "TOTAL=$(echo $PATHS | wc -w)\n";
+        out << "FAILED=\"\"\n";
+        out << "i=0\n";
+        out << "for path in $PATHS; do\n";
+        out << "    i=$((i + 1))\n";
+        out << "    echo \"[$i/$TOTAL] $path\"\n";
+        out << "    [ -n \"$LEVEL_FLAGS\" ] && btrfs filesystem defragment -r $LEVEL_FLAGS \"$path\" && continue\n";
+        out << "    btrfs filesystem defragment -r -czstd \"$path\" || FAILED=\"$FAILED $path\"\n";
+        out << "done\n\n";
+        out << "echo \"$(date) done, ratio after: $(ratio)\"\n";
+        out << "# Recorded either way, so a failing path does not rewrite everything on every boot.\n";
+        out << "if [ -n \"$FAILED\" ]; then\n";
+        out << "    echo \"failed:$FAILED\"\n";
+        out << "    echo \"failed:$FAILED\" > \"$MARKER\"\n";
+        out << "else\n";
+        out << "    touch \"$MARKER\"\n";
+        out << "fi\n";
+        out.flush();
+        return script;
+    }
+
+    static QJsonObject mapToJson(const QMap<QString, QString> &map) {
+        QJsonObject json;
+        for (auto it = map.cbegin(); it != map.cend(); ++it) {
+            json[it.key()] = it.value();
+        }
+        return json;
+    }
+
+    static QMap<QString, QString> mapFromJson(const QJsonObject &json) {
+        QMap<QString, QString> map;
+        for (auto it = json.constBegin(); it != json.constEnd(); ++it) {
+            map[it.key()] = it.value().toString();
+        }
+        return map;
+    }
+
+    static QStringList stringList(const QJsonArray &array) {
+        QStringList list;
+        for (const QJsonValue &value : array) {
+            list << value.toString();
+        }
+        return list;
+    }
+};
+
+// Runs the operations of a plan against one target: its own host values,
+// mount root, command runner, progress bar and log. Several sessions run in
+// parallel when more than one target is installed.
+class InstallSession : public QObject {
+    Q_OBJECT
+
+public:
+    InstallSession(const InstallPlan &plan, const QMap<QString, QString> &host, bool hostScope,
+                   QProgressBar *progressBar, QTextEdit *logArea, QObject *parent = nullptr)
+        : QObject(parent), plan(plan), host(host), progressBar(progressBar), logArea(logArea) {
+        for (const PlanOperation &op : plan.operations) {
+            if (op.hostScope == hostScope) operations << op;
+        }
+
+        commandThread = new QThread;
+        commandRunner = new CommandRunner;
+        commandRunner->moveToThread(commandThread);
+
+        connect(this, &InstallSession::executeCommand, commandRunner, &CommandRunner::runCommand);
+        connect(commandRunner, &CommandRunner::commandStarted, this, &InstallSession::logCommand);
+        connect(commandRunner, &CommandRunner::commandOutput, this, &InstallSession::logOutput);
+        connect(commandRunner, &CommandRunner::commandFinished, this, &InstallSession::commandCompleted);
+
+        commandThread->start();
+    }
+
+    ~InstallSession() {
+        removeTemporaryFiles();
+        commandThread->quit();
+        commandThread->wait();
+        delete commandRunner;
+        delete commandThread;
+    }
+
+    void setSudoPassword(const QString &password) {
+        commandRunner->setSudoPassword(password);
+    }
+
+    void start() {
+        running = true;
+        currentStep = 0;
+        currentStage.clear();
+        progressBar->setValue(5);
+        nextStep();
+    }
+
+    void logMessage(const QString &message) {
+        logArea->append(QString("[%1] %2").arg(QDateTime::currentDateTime().toString("hh:mm:ss"), message));
+        logArea->verticalScrollBar()->setValue(logArea->verticalScrollBar()->maximum());
+    }
+
+signals:
+    void executeCommand(const QString &command, const QStringList &args = QStringList(), bool asRoot = false);
+    void finished(bool success);
+
+private slots:
+    void nextStep() {
+        if (!running) {
+            return;
+        }
+        if (currentStep >= operations.size()) {
+            running = false;
+            removeTemporaryFiles();
+            progressBar->setValue(100);
+            emit finished(true);
+            return;
+        }
+
+        const PlanOperation op = operations[currentStep++];
+        progressBar->setValue((currentStep * 100) / (operations.size() + 1));
+
+        if (op.stage != currentStage) {
+            currentStage = op.stage;
+            logMessage(op.stage);
+        }
+
+        if (op.writesFile()) {
+            commandCompleted(writeGeneratedFile(op));
+            return;
+        }
+
+        emit executeCommand(op.command, plan.resolve(op.args, host), op.asRoot);
+    }
+
+    void commandCompleted(bool success) {
+        if (!running) {
+            return;
+        }
+        if (!success) {
+            logMessage("ERROR: Command failed!");
+            progressBar->setValue(0);
+            running = false;
+            removeTemporaryFiles();
+            emit finished(false);
+            return;
+        }
+
+        QTimer::singleShot(500, this, &InstallSession::nextStep);
+    }
+
+    void logCommand(const QString &command) {
+        logMessage("Executing: " + command);
+    }
+
+    void logOutput(const QString &output) {
+        logArea->insertPlainText(output);
+        logArea->verticalScrollBar()->setValue(logArea->verticalScrollBar()->maximum());
+    }
+
+private:
+    bool writeGeneratedFile(const PlanOperation &op) {
+        const GeneratedFile *file = plan.generatedFile(op.file);
+        if (!file) {
+            logMessage("ERROR: Plan references unknown file " + op.file);
+            return false;
+        }
+
+        QString destination = plan.resolve(file->path, host);
+        logCommand(QString("write %1 (mode %2)").arg(destination, file->mode));
+        if (file->temporary) {
+            temporaryFiles << destination;
+        }
+
+        QTemporaryFile tempFile;
+        if (!tempFile.open()) {
+            return false;
+        }
+
+        QTextStream out(&tempFile);
+        out << plan.resolve(file->content, host);
+        out.flush();
+        tempFile.close();
+
+        return QProcess::execute("install", {"-D", "-m", file->mode, tempFile.fileName(), destination}) == 0;
+    }
+
+    void removeTemporaryFiles() {
+        for (const QString &path : temporaryFiles) {
+            QFile::remove(path);
+        }
+        temporaryFiles.clear();
+    }
+
+    InstallPlan plan;
+    QMap<QString, QString> host;
+    QList<PlanOperation> operations;
+    QStringList temporaryFiles;
+    QProgressBar *progressBar;
+    QTextEdit *logArea;
+    QString currentStage;
+    bool running = false;
+    int currentStep = 0;
+    CommandRunner *commandRunner;
+    QThread *commandThread;
+};
+
 class AlpineInstaller : public QMainWindow {
     Q_OBJECT
 
@@ -167,22 +1843,7 @@ public:
         mainLayout->addWidget(titleLabel);
 
         QHBoxLayout *progressLayout = new QHBoxLayout;
-        progressBar = new QProgressBar;
-        progressBar->setRange(0, 100);
-        progressBar->setTextVisible(true);
-
-        QString progressStyle =
-        "QProgressBar {"
-        "    border: 2px solid grey;"
-        "    border-radius: 5px;"
-        "    text-align: center;"
-        "    background: #252525;"
-        "}"
-        "QProgressBar::chunk {"
-        "    background: qlineargradient(x1:0, y1:0, x2:1, y2:0,"
-        "        stop:0 #00ffff, stop:1 #00aaff);"
-        "}";
-        progressBar->setStyleSheet(progressStyle);
+        progressBar = createProgressBar();
 
         QPushButton *logButton = new QPushButton("Log");
         logButton->setFixedWidth(60);
@@ -192,13 +1853,13 @@ public:
         progressLayout->addWidget(logButton);
         mainLayout->addLayout(progressLayout);
 
-        logArea = new QTextEdit;
-        logArea->setReadOnly(true);
-        logArea->setFont(QFont("Monospace", 10));
-        logArea->setStyleSheet("background-color: #252525; color: #00ffff;");
-        logArea->setVisible(false);
+        logArea = createLogArea();
         mainLayout->addWidget(logArea);
 
+        // One row per target when several disks are installed in parallel.
+        sessionsLayout = new QVBoxLayout;
+        mainLayout->addLayout(sessionsLayout);
+
         QHBoxLayout *buttonLayout = new QHBoxLayout;
         QPushButton *configButton = new QPushButton("Configure Installation");
         QPushButton *mirrorButton = new QPushButton("Find Fastest Mirrors");
@@ -229,7 +1890,9 @@ public:
         connect(this, &AlpineInstaller::executeCommand, commandRunner, &CommandRunner::runCommand);
         connect(commandRunner, &CommandRunner::commandStarted, this, &AlpineInstaller::logCommand);
         connect(commandRunner, &CommandRunner::commandOutput, this, &AlpineInstaller::logOutput);
-        connect(commandRunner, &CommandRunner::commandFinished, this, &AlpineInstaller::commandCompleted);
+        connect(commandRunner, &CommandRunner::commandFinished, this, [this](bool success, const QString &command) {
+            if (!success) logMessage("ERROR: Command failed: " + command);
+        });
 
         commandThread->start();
     }
@@ -241,6 +1904,30 @@ public:
         delete commandThread;
     }
 
+    void loadSettings(const QMap<QString, QString> &values) {
+        for (auto it = values.cbegin(); it != values.cend(); ++it) {
+            settings[it.key()] = it.value();
+        }
+    }
+
+    // Replays a saved plan instead of compiling one from the settings. Only
+    // host-specific values may still be changed in the configuration dialog.
+    void loadPlan(const InstallPlan &saved) {
+        loadedPlan = saved;
+        hasLoadedPlan = true;
+        loadSettings(saved.settings);
+        for (auto it = saved.host.cbegin(); it != saved.host.cend(); ++it) {
+            if (!InstallPlan::detectedKeys().contains(it.key())) {
+                settings[it.key()] = it.value();
+            }
+        }
+        logMessage(QString("Loaded install plan with %1 operations").arg(saved.operations.size()));
+    }
+
+    void setPlanOutputPath(const QString &path) {
+        planOutputPath = path;
+    }
+
 signals:
     void executeCommand(const QString &command, const QStringList &args = QStringList(), bool asRoot = false);
 
@@ -256,11 +1943,11 @@ private slots:
         QFormLayout *form = new QFormLayout(&dialog);
 
         QLineEdit *diskEdit = new QLineEdit(settings["targetDisk"]);
-        diskEdit->setPlaceholderText("e.g. /dev/sda");
-        form->addRow("Target Disk:", diskEdit);
+        diskEdit->setPlaceholderText("e.g. /dev/sda, /dev/nvme0n1 /dev/nvme1n1 or /dev/sda;/dev/sdb for two systems");
+        form->addRow("Target Disks:", diskEdit);
 
         QLineEdit *hostnameEdit = new QLineEdit(settings["hostname"]);
-        hostnameEdit->setPlaceholderText("e.g. alpine");
+        hostnameEdit->setPlaceholderText("e.g. alpine, or lab1;lab2 for several targets");
         form->addRow("Hostname:", hostnameEdit);
 
         QLineEdit *timezoneEdit = new QLineEdit(settings["timezone"]);
@@ -318,6 +2005,51 @@ private slots:
         }
         form->addRow("BTRFS Compression Level:", compressionSpin);
 
+        QComboBox *installCompressionCombo = new QComboBox;
+        installCompressionCombo->addItem("Same as target level", "target");
+        installCompressionCombo->addItem("zstd:1, recompress on first boot", "zstd:1");
+        installCompressionCombo->addItem("None, recompress on first boot", "none");
+        installCompressionCombo->setCurrentIndex(qMax(0, installCompressionCombo->findData(settings["installCompression"])));
+        form->addRow("Install Compression:", installCompressionCombo);
+
+        QComboBox *dataProfileCombo = new QComboBox;
+        dataProfileCombo->addItems({"single", "dup", "raid0", "raid1", "raid10", "raid1c3"});
+        dataProfileCombo->setCurrentText(settings["dataProfile"]);
+        form->addRow("Data Profile:", dataProfileCombo);
+
+        QComboBox *metadataProfileCombo = new QComboBox;
+        metadataProfileCombo->addItems({"dup", "single", "raid0", "raid1", "raid10", "raid1c3"});
+        metadataProfileCombo->setCurrentText(settings["metadataProfile"]);
+        form->addRow("Metadata Profile:", metadataProfileCombo);
+        connect(dataProfileCombo, &QComboBox::currentTextChanged, metadataProfileCombo, [metadataProfileCombo](const QString &profile) {
+            if (profileRedundancy(metadataProfileCombo->currentText()) < profileRedundancy(profile)) {
+                metadataProfileCombo->setCurrentText(profile);
+            }
+        });
+
+        QComboBox *installModeCombo = new QComboBox;
+        installModeCombo->addItem("Fresh install, format the disks", "fresh");
+        installModeCombo->addItem("Reinstall in place, keep @home and data", "reinstall");
+        installModeCombo->setCurrentIndex(qMax(0, installModeCombo->findData(settings["installMode"])));
+        form->addRow("Install Mode:", installModeCombo);
+
+        QCheckBox *encryptionCheck = new QCheckBox("Encrypt the root filesystem with LUKS2");
+        encryptionCheck->setChecked(settings["encryption"] == "luks2");
+        form->addRow("Encryption:", encryptionCheck);
+
+        QPushButton *encryptionPassButton = new QPushButton(settings["encryptionPassword"].isEmpty() ? "Set Encryption Passphrase" : "Change Encryption Passphrase");
+        encryptionPassButton->setEnabled(encryptionCheck->isChecked());
+        form->addRow(encryptionPassButton);
+        connect(encryptionCheck, &QCheckBox::toggled, encryptionPassButton, &QPushButton::setEnabled);
+
+        connect(encryptionPassButton, &QPushButton::clicked, [this, encryptionPassButton]() {
+            PasswordDialog dlg(this);
+            if (dlg.exec() == QDialog::Accepted) {
+                settings["encryptionPassword"] = dlg.password();
+                encryptionPassButton->setText("Change Encryption Passphrase");
+            }
+        });
+
         QPushButton *rootPassButton = new QPushButton(settings["rootPassword"].isEmpty() ? "Set Root Password" : "Change Root Password");
         QPushButton *userPassButton = new QPushButton(settings["userPassword"].isEmpty() ? "Set User Password" : "Change User Password");
         form->addRow(rootPassButton);
@@ -356,9 +2088,14 @@ private slots:
             settings["bootloader"] = bootloaderCombo->currentText();
             settings["initSystem"] = initCombo->currentText();
             settings["compressionLevel"] = QString::number(compressionSpin->value());
+            settings["installCompression"] = installCompressionCombo->currentData().toString();
+            settings["dataProfile"] = dataProfileCombo->currentText();
+            settings["metadataProfile"] = metadataProfileCombo->currentText();
+            settings["encryption"] = encryptionCheck->isChecked() ? "luks2" : "none";
+            settings["installMode"] = installModeCombo->currentData().toString();
 
             logMessage("Installation configured with the following settings:");
-            logMessage(QString("Target Disk: %1").arg(settings["targetDisk"]));
+            logMessage(QString("Target Disks: %1").arg(targetDisks(settings["targetDisk"]).join(" ")));
             logMessage(QString("Hostname: %1").arg(settings["hostname"]));
             logMessage(QString("Timezone: %1").arg(settings["timezone"]));
             logMessage(QString("Keymap: %1").arg(settings["keymap"]));
@@ -367,6 +2104,20 @@ private slots:
             logMessage(QString("Bootloader: %1").arg(settings["bootloader"]));
             logMessage(QString("Init System: %1").arg(settings["initSystem"]));
             logMessage(QString("Compression Level: %1").arg(settings["compressionLevel"]));
+            logMessage(QString("Install Compression: %1").arg(settings["installCompression"]));
+            logMessage(QString("Data/Metadata Profile: %1/%2").arg(settings["dataProfile"], settings["metadataProfile"]));
+            logMessage(QString("Encryption: %1").arg(settings["encryption"]));
+            logMessage(QString("Install Mode: %1").arg(settings["installMode"]));
+
+            if (hasLoadedPlan) {
+                for (auto it = loadedPlan.settings.cbegin(); it != loadedPlan.settings.cend(); ++it) {
+                    if (settings.value(it.key()) != it.value()) {
+                        hasLoadedPlan = false;
+                        logMessage("Settings differ from the loaded plan; a new plan will be compiled.");
+                        break;
+                    }
+                }
+            }
         }
     }
 
@@ -393,18 +2144,12 @@ private slots:
     }
 
     void startInstallation() {
-        QStringList missingFields;
-        if (settings["targetDisk"].isEmpty()) missingFields << "Target Disk";
-        if (settings["hostname"].isEmpty()) missingFields << "Hostname";
-        if (settings["timezone"].isEmpty()) missingFields << "Timezone";
-        if (settings["keymap"].isEmpty()) missingFields << "Keymap";
-        if (settings["username"].isEmpty()) missingFields << "Username";
-        if (settings["desktopEnv"].isEmpty()) missingFields << "Desktop Environment";
-        if (settings["bootloader"].isEmpty()) missingFields << "Bootloader";
-        if (settings["initSystem"].isEmpty()) missingFields << "Init System";
-        if (settings["compressionLevel"].isEmpty()) missingFields << "Compression Level";
-        if (settings["rootPassword"].isEmpty()) missingFields << "Root Password";
-        if (settings["userPassword"].isEmpty()) missingFields << "User Password";
+        if (installing) {
+            return;
+        }
+
+        QStringList missingFields = missingSettings(settings, InstallPlan::requiredKeys(
+            hasLoadedPlan ? InstallPlan::hostKeys() : settings.keys(), settings["encryption"]));
 
         if (!missingFields.isEmpty()) {
             QMessageBox::warning(this, "Error",
@@ -413,8 +2158,74 @@ private slots:
             return;
         }
 
-        QString confirmationText = QString(
-            "About to install to %1 with these settings:\n"
+        QString layoutError = diskLayoutError(settings);
+        QList<QMap<QString, QString>> targets = targetSettings(settings);
+        if (layoutError.isEmpty() && hasLoadedPlan
+            && targetDisks(targets.first()["targetDisk"]).size() != loadedPlan.settings["diskCount"].toInt()) {
+            layoutError = QString("The loaded plan was made for %1 disks").arg(loadedPlan.settings["diskCount"]);
+        }
+        if (!layoutError.isEmpty()) {
+            QMessageBox::warning(this, "Error", layoutError);
+            return;
+        }
+
+        // Detected values go into the per-target copies for this run only, so
+        // a later run on other disks detects them again; explicit overrides in
+        // `settings` win. Every target shares this machine's CPU, so the
+        // benchmarks run once, but the device class is checked per target.
+        bool encrypted = settings["encryption"] == "luks2";
+        BtrfsTuning tuning = BtrfsTuning::detect(targets.first()["targetDisk"]);
+        LuksTuning luks;
+        QString hardwareSummary = tuning.summary();
+        if (encrypted) {
+            luks = LuksTuning::detect(tuning.cpuFeatures, tuning.rotational);
+            hardwareSummary += "\n" + luks.summary();
+        }
+        for (int i = 0; i < targets.size(); ++i) {
+            BtrfsTuning targetTuning = tuning.forDisks(targets[i]["targetDisk"]);
+            targetTuning.fillSettings(targets[i]);
+            if (encrypted) {
+                luks.forDevice(targetTuning.rotational).fillSettings(targets[i]);
+            }
+            if (targets.size() > 1) {
+                hardwareSummary += QString("\nTarget %1: %2, node size %3")
+                    .arg(i + 1).arg(targetTuning.rotational ? "rotational" : "solid state", targets[i]["nodesize"]);
+            }
+        }
+        const QMap<QString, QString> &runSettings = targets.first();
+        QString encryption = "none";
+        if (encrypted) {
+            encryption = QString("LUKS2 %1, %2-bit key").arg(runSettings.value("cipher"), runSettings.value("cipherKeySize"));
+        }
+
+        // A reinstall only goes ahead when every target holds a layout made by
+        // this installer; the ids found there are used for the new fstab.
+        bool reinstall = settings["installMode"] == "reinstall";
+        QList<ExistingInstall> existingInstalls;
+        if (reinstall) {
+            for (const QMap<QString, QString> &target : targets) {
+                ExistingInstall existing = ExistingInstall::detect(targetDisks(target["targetDisk"]),
+                                                                   settings["encryption"] == "luks2",
+                                                                   settings["encryptionPassword"]);
+                if (!existing.error.isEmpty()) {
+                    QMessageBox::warning(this, "Error", "Cannot reinstall in place:\n" + existing.error);
+                    return;
+                }
+                existingInstalls << existing;
+            }
+            hardwareSummary += "\n" + existingInstalls.first().summary();
+        }
+
+        QStringList targetNames;
+        for (const QString &group : targetGroups(settings["targetDisk"])) {
+            targetNames << targetDisks(group).join(", ");
+        }
+
+        QString confirmationHeader = reinstall
+            ? QString("About to reinstall %1 in place. The old @ is kept as a read-only snapshot, "
+                      "@home, @srv and the other subvolumes are not touched.\nSettings:\n")
+            : QString("About to install to %1 with these settings:\n");
+        QString confirmationText = (confirmationHeader + QString(
             "Hostname: %2\n"
             "Timezone: %3\n"
             "Keymap: %4\n"
@@ -422,10 +2233,17 @@ private slots:
             "Desktop: %6\n"
             "Bootloader: %7\n"
             "Init System: %8\n"
-            "Compression Level: %9\n\n"
+            "Compression Level: %9\n"
+            "Install Compression: %10\n"
+            "Data/Metadata Profile: %11/%12\n"
+            "Encryption: %13\n\n"
+            "Btrfs Checksum: %14\n"
+            "Btrfs Features: %15\n"
+            "Node Size: %16\n"
+            "%17\n\n"
             "Continue?"
-        ).arg(
-            settings["targetDisk"],
+        )).arg(
+            targetNames.join("; "),
             settings["hostname"],
             settings["timezone"],
             settings["keymap"],
@@ -433,7 +2251,15 @@ private slots:
             settings["desktopEnv"],
             settings["bootloader"],
             settings["initSystem"],
-            settings["compressionLevel"]
+            settings["compressionLevel"],
+            settings["installCompression"],
+            settings["dataProfile"],
+            settings["metadataProfile"],
+            encryption,
+            runSettings.value("checksum"),
+            runSettings.value("btrfsFeatures"),
+            runSettings.value("nodesize"),
+            hardwareSummary
         );
 
         QMessageBox::StandardButton reply;
@@ -453,252 +2279,118 @@ private slots:
         }
 
         commandRunner->setSudoPassword(passDialog.password());
+        sudoPassword = passDialog.password();
 
-        logMessage("Starting Alpine Linux BTRFS installation...");
-        progressBar->setValue(5);
-
-        currentStep = 0;
-        totalSteps = 15;
-        nextInstallationStep();
-    }
-
-    void nextInstallationStep() {
-        currentStep++;
-        int progress = (currentStep * 100) / totalSteps;
-        progressBar->setValue(progress);
-
-        QString disk1 = settings["targetDisk"] + "1";
-        QString disk2 = settings["targetDisk"] + "2";
-        QString compression = "zstd:" + settings["compressionLevel"];
-
-        switch (currentStep) {
-            case 1:
-                logMessage("Installing required tools...");
-                emit executeCommand("apk", {"add", "btrfs-progs", "parted", "dosfstools", "efibootmgr"}, true);
-                break;
-
-            case 2:
-                logMessage("Loading BTRFS module...");
-                emit executeCommand("modprobe", {"btrfs"}, true);
-                break;
-
-            case 3:
-                logMessage("Partitioning disk...");
-                emit executeCommand("parted", {"-s", settings["targetDisk"], "mklabel", "gpt"}, true);
-                emit executeCommand("parted", {"-s", settings["targetDisk"], "mkpart", "primary", "1MiB", "513MiB"}, true);
-                emit executeCommand("parted", {"-s", settings["targetDisk"], "set", "1", "esp", "on"}, true);
-                emit executeCommand("parted", {"-s", settings["targetDisk"], "mkpart", "primary", "513MiB", "100%"}, true);
-                break;
-
-            case 4:
-                logMessage("Formatting partitions...");
-                emit executeCommand("mkfs.vfat", {"-F32", disk1}, true);
-                emit executeCommand("mkfs.btrfs", {"-f", disk2}, true);
-                break;
-
-            case 5:
-                logMessage("Creating BTRFS subvolumes...");
-                emit executeCommand("mount", {disk2, "/mnt"}, true);
-                emit executeCommand("btrfs", {"subvolume", "create", "/mnt/@"}, true);
-                emit executeCommand("btrfs", {"subvolume", "create", "/mnt/@home"}, true);
-                emit executeCommand("btrfs", {"subvolume", "create", "/mnt/@root"}, true);
-                emit executeCommand("btrfs", {"subvolume", "create", "/mnt/@srv"}, true);
-                emit executeCommand("btrfs", {"subvolume", "create", "/mnt/@tmp"}, true);
-                emit executeCommand("btrfs", {"subvolume", "create", "/mnt/@log"}, true);
-                emit executeCommand("btrfs", {"subvolume", "create", "/mnt/@cache"}, true);
-                emit executeCommand("btrfs", {"subvolume", "create", "/mnt/@/var/lib/portables"}, true);
-                emit executeCommand("btrfs", {"subvolume", "create", "/mnt/@/var/lib/machines"}, true);
-                emit executeCommand("umount", {"/mnt"}, true);
-                break;
-
-            case 6:
-                logMessage("Remounting with compression...");
-                emit executeCommand("mount", {"-o", QString("subvol=@,compress=%1,compress-force=%1").arg(compression), disk2, "/mnt"}, true);
-                emit executeCommand("mkdir", {"-p", "/mnt/boot/efi"}, true);
-                emit executeCommand("mount", {disk1, "/mnt/boot/efi"}, true);
-                emit executeCommand("mkdir", {"-p", "/mnt/home"}, true);
-                emit executeCommand("mkdir", {"-p", "/mnt/root"}, true);
-                emit executeCommand("mkdir", {"-p", "/mnt/srv"}, true);
-                emit executeCommand("mkdir", {"-p", "/mnt/tmp"}, true);
-                emit executeCommand("mkdir", {"-p", "/mnt/var/cache"}, true);
-                emit executeCommand("mkdir", {"-p", "/mnt/var/log"}, true);
-                emit executeCommand("mkdir", {"-p", "/mnt/var/lib/portables"}, true);
-                emit executeCommand("mkdir", {"-p", "/mnt/var/lib/machines"}, true);
-                emit executeCommand("mount", {"-o", QString("subvol=@home,compress=%1,compress-force=%1").arg(compression), disk2, "/mnt/home"}, true);
-                emit executeCommand("mount", {"-o", QString("subvol=@root,compress=%1,compress-force=%1").arg(compression), disk2, "/mnt/root"}, true);
-                emit executeCommand("mount", {"-o", QString("subvol=@srv,compress=%1,compress-force=%1").arg(compression), disk2, "/mnt/srv"}, true);
-                emit executeCommand("mount", {"-o", QString("subvol=@tmp,compress=%1,compress-force=%1").arg(compression), disk2, "/mnt/tmp"}, true);
-                emit executeCommand("mount", {"-o", QString("subvol=@log,compress=%1,compress-force=%1").arg(compression), disk2, "/mnt/var/log"}, true);
-                emit executeCommand("mount", {"-o", QString("subvol=@cache,compress=%1,compress-force=%1").arg(compression), disk2, "/mnt/var/cache"}, true);
-                emit executeCommand("mount", {"-o", QString("subvol=@/var/lib/portables,compress=%1,compress-force=%1").arg(compression), disk2, "/mnt/var/lib/portables"}, true);
-                emit executeCommand("mount", {"-o", QString("subvol=@/var/lib/machines,compress=%1,compress-force=%1").arg(compression), disk2, "/mnt/var/lib/machines"}, true);
-                break;
-
-            case 7:
-                logMessage("Installing base system...");
-                emit executeCommand("setup-disk", {"-m", "sys", "/mnt"}, true);
-                break;
-
-            case 8:
-                logMessage("Preparing chroot environment...");
-                emit executeCommand("mount", {"-t", "proc", "none", "/mnt/proc"}, true);
-                emit executeCommand("mount", {"--rbind", "/dev", "/mnt/dev"}, true);
-                emit executeCommand("mount", {"--rbind", "/sys", "/mnt/sys"}, true);
-                break;
-
-            case 9:
-                logMessage("Preparing chroot setup script...");
-                createChrootScript();
-                emit executeCommand("chmod", {"+x", "/mnt/setup-chroot.sh"}, true);
-                break;
+        // Every target carries its own detected values.
+        installTargets = targets;
+        plan = hasLoadedPlan ? loadedPlan : InstallPlan::compile(installTargets.first());
+        for (int i = 0; i < existingInstalls.size(); ++i) {
+            existingInstalls[i].fillSettings(installTargets[i]);
+        }
+        logMessage(QString("Install plan ready: %1 operations, %2 generated files")
+                   .arg(plan.operations.size()).arg(plan.files.size()));
 
-            case 10:
-                logMessage("Running chroot setup...");
-                emit executeCommand("chroot", {"/mnt", "/setup-chroot.sh"}, true);
-                break;
+        if (!planOutputPath.isEmpty()) {
+            QString error;
+            if (plan.save(planOutputPath, &error)) {
+                logMessage("Install plan saved to " + planOutputPath);
+            } else {
+                logMessage("WARNING: Could not save install plan: " + error);
+            }
+        }
 
-            case 11:
-                logMessage("Cleaning up...");
-                emit executeCommand("umount", {"-R", "/mnt"}, true);
-                break;
+        logMessage("Starting Alpine Linux BTRFS installation...");
+        installing = true;
+        clearSessions();
+
+        // Host preparation (tools, modules, package cache) runs once, then
+        // every target gets its own session.
+        InstallSession *hostSession = new InstallSession(plan, plan.hostValues(installTargets.first()), true,
+                                                         progressBar, logArea, this);
+        hostSession->setSudoPassword(sudoPassword);
+        connect(hostSession, &InstallSession::finished, this, [this, hostSession](bool success) {
+            hostSession->deleteLater();
+            if (!success) {
+                installing = false;
+                QMessageBox::critical(this, "Error", "Preparing the installer host failed. Check the log for details.");
+                return;
+            }
+            startTargetSessions();
+        });
+        hostSession->start();
+    }
 
-            case 12:
-                logMessage("Installation complete!");
-                progressBar->setValue(100);
-                showPostInstallOptions();
-                break;
+    void startTargetSessions() {
+        failedTargets.clear();
+        pendingSessions = installTargets.size();
+
+        for (int i = 0; i < installTargets.size(); ++i) {
+            const QMap<QString, QString> &target = installTargets[i];
+            QMap<QString, QString> host = plan.hostValues(target);
+            QString name = QString("Target %1: %2 (%3)")
+                .arg(i + 1).arg(targetDisks(host["targetDisk"]).join(", "), host["hostname"]);
+
+            QProgressBar *sessionProgress = progressBar;
+            QTextEdit *sessionLog = logArea;
+            if (installTargets.size() > 1) {
+                QWidget *row = new QWidget;
+                QVBoxLayout *rowLayout = new QVBoxLayout(row);
+                rowLayout->setContentsMargins(0, 0, 0, 0);
+                QHBoxLayout *barLayout = new QHBoxLayout;
+                sessionProgress = createProgressBar();
+                sessionLog = createLogArea();
+                QPushButton *logButton = new QPushButton("Log");
+                logButton->setFixedWidth(60);
+                connect(logButton, &QPushButton::clicked, sessionLog, [sessionLog]() {
+                    sessionLog->setVisible(!sessionLog->isVisible());
+                });
+                barLayout->addWidget(new QLabel(name));
+                barLayout->addWidget(sessionProgress, 1);
+                barLayout->addWidget(logButton);
+                rowLayout->addLayout(barLayout);
+                rowLayout->addWidget(sessionLog);
+                sessionsLayout->addWidget(row);
+                sessionRows << row;
+            }
 
-            default:
-                break;
+            InstallSession *session = new InstallSession(plan, host, false, sessionProgress, sessionLog, this);
+            session->setSudoPassword(sudoPassword);
+            connect(session, &InstallSession::finished, this, [this, name](bool success) {
+                sessionFinished(name, success);
+            });
+            sessions << session;
+            logMessage("Starting " + name);
+            session->start();
         }
     }
 
-    void commandCompleted(bool success) {
+    void sessionFinished(const QString &name, bool success) {
+        logMessage(QString("%1 %2").arg(name, success ? "installed" : "FAILED"));
         if (!success) {
-            logMessage("ERROR: Command failed!");
-            QMessageBox::critical(this, "Error", "A command failed during installation. Check the log for details.");
-            progressBar->setValue(0);
+            failedTargets << name;
+        }
+        if (--pendingSessions > 0) {
             return;
         }
 
-        QTimer::singleShot(500, this, &AlpineInstaller::nextInstallationStep);
-    }
-
-    void createChrootScript() {
-        QTemporaryFile tempFile;
-        if (tempFile.open()) {
-            QTextStream out(&tempFile);
-
-            out << "#!/bin/ash\n\n";
-            out << "# Basic system configuration\n";
-            out << "echo \"root:" << settings["rootPassword"] << "\" | chpasswd\n";
-            out << "adduser -D " << settings["username"] << " -G wheel,video,audio,input\n";
-            out << "echo \"" << settings["username"] << ":" << settings["userPassword"] << "\" | chpasswd\n";
-            out << "setup-timezone -z " << settings["timezone"] << "\n";
-            out << "setup-keymap " << settings["keymap"] << " " << settings["keymap"] << "\n";
-            out << "echo \"" << settings["hostname"] << "\" > /etc/hostname\n\n";
-
-            QString disk1 = settings["targetDisk"] + "1";
-            QString disk2 = settings["targetDisk"] + "2";
-            QString compression = "zstd:" + settings["compressionLevel"];
-
-            out << "cat << EOF > /etc/fstab\n";
-            out << disk1 << " /boot/efi vfat defaults 0 2\n";
-            out << disk2 << " / btrfs rw,noatime,compress=" << compression << ",compress-force=" << compression << ",subvol=@ 0 1\n";
-            out << disk2 << " /home btrfs rw,noatime,compress=" << compression << ",compress-force=" << compression << ",subvol=@home 0 2\n";
-            out << disk2 << " /root btrfs rw,noatime,compress=" << compression << ",compress-force=" << compression << ",subvol=@root 0 2\n";
-            out << disk2 << " /srv btrfs rw,noatime,compress=" << compression << ",compress-force=" << compression << ",subvol=@srv 0 2\n";
-            out << disk2 << " /tmp btrfs rw,noatime,compress=" << compression << ",compress-force=" << compression << ",subvol=@tmp 0 2\n";
-            out << disk2 << " /var/log btrfs rw,noatime,compress=" << compression << ",compress-force=" << compression << ",subvol=@log 0 2\n";
-            out << disk2 << " /var/cache btrfs rw,noatime,compress=" << compression << ",compress-force=" << compression << ",subvol=@cache 0 2\n";
-            out << disk2 << " /var/lib/portables btrfs rw,noatime,compress=" << compression << ",compress-force=" << compression << ",subvol=@/var/lib/portables 0 2\n";
-            out << disk2 << " /var/lib/machines btrfs rw,noatime,compress=" << compression << ",compress-force=" << compression << ",subvol=@/var/lib/machines 0 2\n";
-            out << "EOF\n\n";
-
-            out << "apk update\n";
-
-            QString loginManager = "none";
-            if (settings["desktopEnv"] == "KDE Plasma") {
-                out << "setup-desktop plasma\n";
-                out << "apk add plasma-nm\n";
-                loginManager = "sddm";
-            } else if (settings["desktopEnv"] == "GNOME") {
-                out << "setup-desktop gnome\n";
-                out << "apk add networkmanager-gnome\n";
-                loginManager = "gdm";
-            } else if (settings["desktopEnv"] == "XFCE") {
-                out << "setup-desktop xfce\n";
-                out << "apk add networkmanager-gtk\n";
-                loginManager = "lightdm";
-            } else if (settings["desktopEnv"] == "MATE") {
-                out << "setup-desktop mate\n";
-                out << "apk add networkmanager-gtk\n";
-                loginManager = "lightdm";
-            } else if (settings["desktopEnv"] == "LXQt") {
-                out << "setup-desktop lxqt\n";
-                out << "apk add networkmanager-qt\n";
-                loginManager = "lightdm";
+        installing = false;
+        if (installTargets.size() == 1) {
+            if (failedTargets.isEmpty()) {
+                logMessage("Installation complete!");
+                showPostInstallOptions();
             } else {
-                out << "echo \"No desktop environment selected\"\n";
-                out << "apk add networkmanager\n";
-            }
-
-            if (settings["bootloader"] == "GRUB") {
-                out << "apk add grub-efi\n";
-                out << "grub-install --target=x86_64-efi --efi-directory=/boot/efi --bootloader-id=ALPINE\n";
-                out << "grub-mkconfig -o /boot/grub/grub.cfg\n";
-            } else if (settings["bootloader"] == "rEFInd") {
-                out << "apk add refind\n";
-                out << "refind-install\n";
-            }
-
-            if (settings["initSystem"] == "OpenRC") {
-                out << "rc-update add dbus\n";
-                out << "rc-update add networkmanager\n";
-                if (loginManager != "none") {
-                    out << "rc-update add " << loginManager << "\n";
-                }
-            } else if (settings["initSystem"] == "sysvinit") {
-                out << "apk add sysvinit openrc\n";
-                out << "ln -sf /etc/inittab.sysvinit /etc/inittab\n";
-                if (loginManager != "none") {
-                    out << "ln -s /etc/init.d/" << loginManager << " /etc/rc.d/\n";
-                }
-                out << "ln -s /etc/init.d/dbus /etc/rc.d/\n";
-                out << "ln -s /etc/init.d/networkmanager /etc/rc.d/\n";
-            } else if (settings["initSystem"] == "runit") {
-                out << "apk add runit runit-openrc\n";
-                out << "mkdir -p /etc/service\n";
-                if (loginManager != "none") {
-                    out << "mkdir -p /etc/service/" << loginManager << "\n";
-                    out << "echo '#!/bin/sh' > /etc/service/" << loginManager << "/run\n";
-                    out << "echo 'exec /etc/init.d/" << loginManager << " start' >> /etc/service/" << loginManager << "/run\n";
-                    out << "chmod +x /etc/service/" << loginManager << "/run\n";
-                }
-                out << "mkdir -p /etc/service/dbus\n";
-                out << "echo '#!/bin/sh' > /etc/service/dbus/run\n";
-                out << "echo 'exec /etc/init.d/dbus start' >> /etc/service/dbus/run\n";
-                out << "chmod +x /etc/service/dbus/run\n";
-            } else if (settings["initSystem"] == "s6") {
-                out << "apk add s6 s6-openrc\n";
-                out << "mkdir -p /etc/s6/sv\n";
-                if (loginManager != "none") {
-                    out << "mkdir -p /etc/s6/sv/" << loginManager << "\n";
-                    out << "echo '#!/bin/sh' > /etc/s6/sv/" << loginManager << "/run\n";
-                    out << "echo 'exec /etc/init.d/" << loginManager << " start' >> /etc/s6/sv/" << loginManager << "/run\n";
-                    out << "chmod +x /etc/s6/sv/" << loginManager << "/run\n";
-                }
-                out << "mkdir -p /etc/s6/sv/dbus\n";
-                out << "echo '#!/bin/sh' > /etc/s6/sv/dbus/run\n";
-                out << "echo 'exec /etc/init.d/dbus start' >> /etc/s6/sv/dbus/run\n";
-                out << "chmod +x /etc/s6/sv/dbus/run\n";
+                QMessageBox::critical(this, "Error", "A command failed during installation. Check the log for details.");
             }
+            return;
+        }
 
-            out << "rm /setup-chroot.sh\n";
-
-            tempFile.close();
-
-            QProcess::execute("cp", {tempFile.fileName(), "/mnt/setup-chroot.sh"});
+        int installed = installTargets.size() - failedTargets.size();
+        QString summary = QString("%1 of %2 targets installed.").arg(installed).arg(installTargets.size());
+        if (failedTargets.isEmpty()) {
+            QMessageBox::information(this, "Installation Complete", summary);
+        } else {
+            QMessageBox::warning(this, "Installation Finished",
+                                 summary + "\n\nFailed:\n" + failedTargets.join("\n") + "\n\nCheck the target logs for details.");
         }
     }
 
@@ -725,11 +2417,22 @@ private slots:
 
         connect(chrootButton, &QPushButton::clicked, [this, &dialog]() {
             logMessage("Entering chroot...");
-            QString disk1 = settings["targetDisk"] + "1";
-            QString disk2 = settings["targetDisk"] + "2";
+            QString disk = targetDisks(settings["targetDisk"]).value(0);
+            bool encrypted = settings["encryption"] == "luks2";
+            QString rootDevice = partitionPath(disk, 2);
+
+            if (encrypted) {
+                QTemporaryFile keyFile;
+                if (keyFile.open()) {
+                    keyFile.write(settings["encryptionPassword"].toUtf8());
+                    keyFile.close();
+                    QProcess::execute("cryptsetup", {"open", "--key-file", keyFile.fileName(), rootDevice, "cryptroot"});
+                }
+                rootDevice = "/dev/mapper/cryptroot";
+            }
 
-            emit executeCommand("mount", {disk1, "/mnt/boot/efi"}, true);
-            emit executeCommand("mount", {"-o", "subvol=@", disk2, "/mnt"}, true);
+            emit executeCommand("mount", {"-o", "subvol=@", rootDevice, "/mnt"}, true);
+            emit executeCommand("mount", {partitionPath(disk, 1), "/mnt" + espMountPoint(1, encrypted)}, true);
             emit executeCommand("mount", {"-t", "proc", "none", "/mnt/proc"}, true);
             emit executeCommand("mount", {"--rbind", "/dev", "/mnt/dev"}, true);
             emit executeCommand("mount", {"--rbind", "/sys", "/mnt/sys"}, true);
@@ -761,29 +2464,247 @@ private slots:
 
 private:
     void initSettings() {
-        settings["targetDisk"] = "";
-        settings["hostname"] = "";
-        settings["timezone"] = "";
-        settings["keymap"] = "";
-        settings["username"] = "";
-        settings["desktopEnv"] = "";
-        settings["bootloader"] = "";
-        settings["initSystem"] = "";
-        settings["compressionLevel"] = "";
-        settings["rootPassword"] = "";
-        settings["userPassword"] = "";
+        settings = defaultSettings();
+    }
+
+    static QProgressBar *createProgressBar() {
+        QProgressBar *bar = new QProgressBar;
+        bar->setRange(0, 100);
+        bar->setTextVisible(true);
+
+        QString progressStyle =
+        "QProgressBar {"
+        "    border: 2px solid grey;"
+        "    border-radius: 5px;"
+        "    text-align: center;"
+        "    background: #252525;"
+        "}"
+        "QProgressBar::chunk {"
+        "    background: qlineargradient(x1:0, y1:0, x2:1, y2:0,"
+        "        stop:0 #00ffff, stop:1 #00aaff);"
+        "}";
+        bar->setStyleSheet(progressStyle);
+        return bar;
+    }
+
+    static QTextEdit *createLogArea() {
+        QTextEdit *log = new QTextEdit;
+        log->setReadOnly(true);
+        log->setFont(QFont("Monospace", 10));
+        log->setStyleSheet("background-color: #252525; color: #00ffff;");
+        log->setVisible(false);
+        return log;
+    }
+
+    void clearSessions() {
+        qDeleteAll(sessions);
+        sessions.clear();
+        qDeleteAll(sessionRows);
+        sessionRows.clear();
     }
 
     QProgressBar *progressBar;
     QTextEdit *logArea;
     QMap<QString, QString> settings;
-    int currentStep;
-    int totalSteps;
+    QVBoxLayout *sessionsLayout;
+    InstallPlan plan;
+    InstallPlan loadedPlan;
+    bool hasLoadedPlan = false;
+    QString planOutputPath;
+    QString sudoPassword;
+    QList<QMap<QString, QString>> installTargets;
+    QList<InstallSession *> sessions;
+    QList<QWidget *> sessionRows;
+    QStringList failedTargets;
+    bool installing = false;
+    int pendingSessions = 0;
     CommandRunner *commandRunner;
     QThread *commandThread;
 };
 
 int main(int argc, char *argv[]) {
+    QStringList arguments;
+    for (int i = 0; i < argc; ++i) {
+        arguments << QString::fromLocal8Bit(argv[i]);
+    }
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Alpine Linux BTRFS Installer");
+    QCommandLineOption helpOption = parser.addHelpOption();
+    QCommandLineOption dryRunOption("dry-run", "Print the install plan and exit without touching any disk.");
+    QCommandLineOption planOption("plan", "Replay the install plan saved in <file>.", "file");
+    QCommandLineOption savePlanOption("save-plan", "Save the compiled install plan to <file>.", "file");
+    QCommandLineOption setOption("set", "Set an installer setting, e.g. --set targetDisk=/dev/sdb.", "key=value");
+    QCommandLineOption secretsOption("secrets-file",
+        "Read rootPassword, userPassword and encryptionPassword as key=value lines from <file> (mode 0600, - for stdin).", "file");
+    parser.addOptions({dryRunOption, planOption, savePlanOption, setOption, secretsOption});
+
+    if (!parser.parse(arguments)) {
+        QTextStream(stderr) << parser.errorText() << "\n";
+        return 1;
+    }
+    if (parser.isSet(helpOption)) {
+        QTextStream(stdout) << parser.helpText();
+        return 0;
+    }
+
+    InstallPlan savedPlan;
+    if (parser.isSet(planOption)) {
+        QString error;
+        if (!InstallPlan::load(parser.value(planOption), &savedPlan, &error)) {
+            QTextStream(stderr) << "Cannot load plan " << parser.value(planOption) << ": " << error << "\n";
+            return 1;
+        }
+    }
+
+    QMap<QString, QString> overrides;
+    for (const QString &assignment : parser.values(setOption)) {
+        int separator = assignment.indexOf('=');
+        if (separator <= 0) {
+            QTextStream(stderr) << "Invalid --set value: " << assignment << "\n";
+            return 1;
+        }
+        QString key = assignment.left(separator);
+        // Command lines end up in /proc/*/cmdline and shell history.
+        if (InstallPlan::secretKeys().contains(key)) {
+            QTextStream(stderr) << key << " cannot be passed with --set, use --secrets-file or the dialog\n";
+            return 1;
+        }
+        if (parser.isSet(planOption) && !InstallPlan::hostKeys().contains(key)) {
+            QTextStream(stderr) << "Only host values (" << InstallPlan::hostKeys().join(", ")
+                                << ") can be changed when replaying a plan\n";
+            return 1;
+        }
+        overrides[key] = assignment.mid(separator + 1);
+    }
+
+    if (parser.isSet(secretsOption)) {
+        QString path = parser.value(secretsOption);
+        QFile secrets;
+        bool opened = false;
+        if (path == "-") {
+            opened = secrets.open(stdin, QIODevice::ReadOnly | QIODevice::Text);
+        } else {
+            secrets.setFileName(path);
+            if (secrets.permissions() & (QFileDevice::ReadGroup | QFileDevice::ReadOther)) {
+                QTextStream(stderr) << path << " is readable by other users, chmod 600 it first\n";
+                return 1;
+            }
+            opened = secrets.open(QIODevice::ReadOnly | QIODevice::Text);
+        }
+        if (!opened) {
+            QTextStream(stderr) << "Cannot read secrets from " << path << "\n";
+            return 1;
+        }
+
+        QTextStream in(&secrets);
+        QString line;
+        while (in.readLineInto(&line)) {
+            if (line.trimmed().isEmpty() || line.startsWith('#')) continue;
+            int separator = line.indexOf('=');
+            QString key = line.left(separator);
+            if (separator <= 0 || !InstallPlan::secretKeys().contains(key)) {
+                QTextStream(stderr) << "Invalid line in " << path << ", expected one of "
+                                    << InstallPlan::secretKeys().join(", ") << "\n";
+                return 1;
+            }
+            overrides[key] = line.mid(separator + 1);
+        }
+    }
+
+    if (parser.isSet(dryRunOption)) {
+        QCoreApplication app(argc, argv);
+        QTextStream out(stdout);
+
+        QMap<QString, QString> settings = defaultSettings();
+        for (auto it = overrides.cbegin(); it != overrides.cend(); ++it) {
+            settings[it.key()] = it.value();
+        }
+
+        // A replayed plan supplies the host values that were not set again.
+        if (parser.isSet(planOption)) {
+            for (auto it = savedPlan.host.cbegin(); it != savedPlan.host.cend(); ++it) {
+                if (settings.value(it.key()).isEmpty()) settings[it.key()] = it.value();
+            }
+        }
+        QList<QMap<QString, QString>> targets = targetSettings(settings);
+        if (targets.isEmpty()) {
+            targets << settings;
+        }
+
+        InstallPlan plan = parser.isSet(planOption) ? savedPlan : InstallPlan::compile(targets.first());
+        BtrfsTuning tuning = BtrfsTuning::detect(targets.first().value("targetDisk"));
+        QString hardwareSummary = tuning.summary();
+        QString encryption = parser.isSet(planOption) ? plan.settings["encryption"] : settings["encryption"];
+        LuksTuning luks;
+        if (encryption == "luks2") {
+            luks = LuksTuning::detect(tuning.cpuFeatures, tuning.rotational);
+            hardwareSummary += "\n" + luks.summary();
+        }
+        for (QMap<QString, QString> &target : targets) {
+            BtrfsTuning targetTuning = tuning.forDisks(target.value("targetDisk"));
+            targetTuning.fillSettings(target);
+            if (encryption == "luks2") luks.forDevice(targetTuning.rotational).fillSettings(target);
+        }
+        // A dry run never touches the disks, so the ids a reinstall keeps are
+        // shown as placeholders instead of being probed.
+        if (plan.settings["installMode"] == "reinstall") {
+            for (QMap<QString, QString> &target : targets) {
+                for (const QString &key : QStringList{"rootUuid", "luksUuid"}) {
+                    target[key] = "${" + key + "}";
+                }
+                for (int i = 1; i <= targetDisks(target.value("targetDisk")).size(); ++i) {
+                    for (const QString &field : QStringList{"espUuid", "espId"}) {
+                        QString key = QString("disk%1.%2").arg(i).arg(field);
+                        target[key] = "${" + key + "}";
+                    }
+                }
+            }
+            hardwareSummary += "\nReinstall: filesystem and ESP ids are read from the disks at install time";
+        }
+
+        for (const QString &line : hardwareSummary.split('\n')) {
+            out << "# " << line << "\n";
+        }
+
+        QStringList required = InstallPlan::requiredKeys(
+            parser.isSet(planOption) ? InstallPlan::hostKeys() : settings.keys(), encryption);
+        for (const QString &key : InstallPlan::secretKeys()) {
+            required.removeAll(key);
+        }
+        QStringList missing = missingSettings(targets.first(), required);
+        if (!missing.isEmpty()) {
+            out << "# WARNING: unset settings: " << missing.join(", ") << "\n";
+        }
+        QMap<QString, QString> layout = plan.settings;
+        layout["targetDisk"] = settings.value("targetDisk");
+        QString layoutError = diskLayoutError(layout);
+        int disks = targetDisks(targets.first().value("targetDisk")).size();
+        if (layoutError.isEmpty() && disks > 0 && disks != layout["diskCount"].toInt()) {
+            layoutError = QString("The plan was made for %1 disks").arg(layout["diskCount"]);
+        }
+        if (!layoutError.isEmpty()) {
+            out << "# WARNING: " << layoutError << "\n";
+        }
+
+        for (int i = 0; i < targets.size(); ++i) {
+            if (targets.size() > 1) {
+                out << (i == 0 ? "" : "\n") << "# target " << i + 1 << ": " << targets[i]["targetDisk"]
+                    << " mounted at " << targets[i]["root"] << "\n";
+            }
+            out << plan.describe(plan.hostValues(targets[i]));
+        }
+
+        if (parser.isSet(savePlanOption)) {
+            QString error;
+            if (!plan.save(parser.value(savePlanOption), &error)) {
+                QTextStream(stderr) << "Cannot save plan: " << error << "\n";
+                return 1;
+            }
+        }
+        return 0;
+    }
+
     QApplication app(argc, argv);
 
     if (QProcess::execute("whoami", QStringList()) != 0) {
@@ -792,6 +2713,11 @@ int main(int argc, char *argv[]) {
     }
 
     AlpineInstaller installer;
+    if (parser.isSet(planOption)) {
+        installer.loadPlan(savedPlan);
+    }
+    installer.loadSettings(overrides);
+    installer.setPlanOutputPath(parser.value(savePlanOption));
     installer.show();
 
     return app.exec();